@@ -1,17 +1,533 @@
+#define _DEFAULT_SOURCE  // clock_gettime(), mmap(), M_PI and friends under -std=c99
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <float.h>
 #include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+// Decompression libraries are optional: the Makefile defines HAVE_* for
+// the ones whose headers it finds
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Size of the stdio read buffer used by read_numbers (grows for huge tokens)
+#define READ_CHUNK_SIZE (1 << 20)
+
+// Longest token the slow parser path copies onto the stack
+#define SLOW_TOKEN_MAX 512
+
+// Values parse_text() collects before handing them to a ValueSink
+#define PARSE_BATCH 256
+
+// introselect() finishes ranges this small with an insertion sort
+#define SELECT_INSERTION_MAX 16
+
+// Radix sort digit width, and the size below which sort_doubles() uses qsort()
+#define RADIX_BITS 11
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES ((64 + RADIX_BITS - 1) / RADIX_BITS)
+#define RADIX_SORT_MIN 1024
+
+// Parallel sort: smallest input worth splitting, and samples per thread
+// used to pick the bucket splitters
+#define PARALLEL_SORT_MIN (1 << 16)
+#define SORT_OVERSAMPLING 64
+
+// Values per block in moments_add(): small enough to stay in L1 between
+// the two passes of the moments kernel
+#define MOMENT_BLOCK 1024
+
+// Values per partial in moments_reduce(). The partials are fixed by the
+// input, not by the thread count, so every -t gives the same result.
+#define REDUCE_CHUNK (1 << 16)
+
+// Value arrays (store_create()): address space is reserved up front and
+// made usable STORE_SEGMENT bytes at a time, on huge-page boundaries
+#define STORE_SEGMENT (64 << 20)
+#define STORE_ALIGN (2 << 20)
+#define STORE_HEADER 64     // Bookkeeping before the values, keeps them 64-byte aligned
+
+// Address space reserved when the input size is unknown (pipes)
+#define STORE_RESERVE_UNKNOWN ((size_t)1 << (sizeof(size_t) > 4 ? 40 : 28))
+
+// Compressed input (decoder_start()): bytes read per read(2), and the ring
+// of buffers the decoder thread fills ahead of the parser
+#define DECODE_INPUT (256 << 10)
+#define DECODE_SLOTS 4
+#define DECODE_SLOT_SIZE (1 << 20)
+
+// Longest magic number looked for at the start of the input (xz)
+#define MAGIC_MAX 6
+
+// Smallest slice of input handed to a parsing thread
+#define MIN_PARSE_CHUNK (1 << 16)
+
+// Repetitions per reader in --bench-parse (best time is reported)
+#define BENCH_RUNS 3
+
+// Readers compared by --bench-parse: fscanf, stdio stream, mmap
+#define BENCH_READERS 3
+
+// Most percentiles --percentiles accepts
+#define MAX_PERCENTILES 32
+
+// Most bins --hist accepts, and the width of the longest text bar
+#define MAX_HIST_BINS 10000
+#define HIST_BAR_WIDTH 40
+#define HIST_BAR "########################################"
+
+// Significant digits --hdr accepts
+#define HDR_MAX_SIGFIGS 5
+
+// IEEE-754 exponents an HDR histogram keys on: 0 (subnormals) to 2046,
+// and 2047 for infinity
+#define HDR_OCTAVES 2048
+
+// Height limit of the --window order-statistic skiplist (2^32 values)
+#define SKIP_MAX_LEVEL 32
+
+// Binary f64le records can be used in place only on a little-endian host
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_LITTLE_ENDIAN 1
+#else
+#define HOST_LITTLE_ENDIAN 0
+#endif
+
+// How the input is brought into memory
+typedef enum {
+    IO_AUTO,    // mmap regular files, stream everything else
+    IO_MMAP,    // always mmap (fails on pipes and terminals)
+    IO_STREAM   // always read through stdio
+} IoMode;
+
+// Layout of the input: whitespace-separated text or packed binary records
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_F64LE,   // IEEE-754 double, little-endian
+    FORMAT_F32LE,   // IEEE-754 float, little-endian
+    FORMAT_I64LE,   // Signed 64-bit integer, little-endian
+    FORMAT_I32LE    // Signed 32-bit integer, little-endian
+} InputFormat;
+
+// Which part of each line holds the numbers
+typedef struct {
+    int column;     // 1-based field to extract, 0 = every token on the line
+    char delim;     // Field separator for column, 0 = runs of blanks
+    int all;        // --all-columns: every field, each column on its own
+    int key;        // --group-by: 1-based field holding the group key, or 0
+    int time;       // --time-col: 1-based field holding the timestamp, or 0
+} Columns;
 
 // Configuration structure
 typedef struct {
     int json_output;
     int precision;
+    int bench_parse;
+    size_t bench_sort;  // Values per --bench-sort input, 0 = no benchmark
+    int full_sort;
+    IoMode io_mode;
+    InputFormat format;
+    Columns columns;
+    int threads;
+    int stream;
+    double tdigest;     // t-digest compression, 0 = exact quantiles
+    size_t window;      // --window: values per rolling window, 0 = off
+    size_t every;       // Report every this many values, 0 = not set (--window: every value)
+    double interval;    // --interval: seconds between snapshots, 0 = off
     char *input_file;
+    double percentiles[MAX_PERCENTILES];  // --percentiles, in percent
+    size_t n_percentiles;
+    long bucket;        // --bucket width in seconds
+    size_t hist_bins;   // --hist: number of histogram bins, 0 = no histogram
+    int log_hist;       // --log-hist: bins equally wide in log(value)
+    int hdr;            // --hdr: significant digits of the HDR histogram, 0 = off
+    int float32;        // --float32: keep the values as 4-byte floats
 } Config;
 
+// Destination for parsed values. consume() receives them in batches and
+// returns nonzero if it cannot take them (out of memory).
+typedef struct {
+    int (*consume)(void *ctx, const double *values, size_t n);
+    void *ctx;
+} ValueSink;
+
+// Bookkeeping at the start of a value store, STORE_HEADER bytes before
+// the values
+typedef struct {
+    size_t reserved;    // Bytes of address space, 0 = malloc()ed (grown by realloc())
+    size_t committed;   // Bytes readable and writable, header included
+} StoreHeader;
+
+// Growable array of parsed values, in a value store
+typedef struct {
+    double *data;
+    size_t count;
+    size_t capacity;
+} ValueBuffer;
+
+// Growable array of parsed values narrowed to float (--float32), in a
+// value store
+typedef struct {
+    float *data;
+    size_t count;
+    size_t capacity;
+} FloatBuffer;
+
+// Outcome of parse_text()
+typedef enum {
+    PARSE_END,      // Consumed the whole range
+    PARSE_STOP,     // Hit a non-number: input ends here, as with fscanf()
+    PARSE_NOMEM     // The sink ran out of memory
+} ParseStatus;
+
+// Parses a range of complete tokens or lines handed out by read_blocks()
+typedef ParseStatus (*BlockParser)(const char *p, const char *end, void *ctx);
+
+// One thread's slice of a mapped input for read_numbers_mmap()
+typedef struct {
+    const char *begin;
+    const char *end;
+    ValueBuffer values;
+    ParseStatus status;
+    double *dest;       // Where the values land in the stitched array
+    const Columns *columns;
+    size_t expected;    // Most values the buffer may need to hold
+} ParseChunk;
+
+// Compression recognised by its magic number at the start of the input
+typedef enum {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_XZ,
+    COMPRESS_ZSTD
+} Compression;
+
+// Decompresses the input on a thread of its own into a ring of
+// DECODE_SLOTS buffers, which read_available() drains while the next ones
+// are filled
+typedef struct {
+    int fd;                     // Compressed input
+    int wake[2];                // Pipe decoder_free() writes to, to end a wait for input
+    Compression kind;
+    unsigned char *in;          // DECODE_INPUT bytes of compressed input
+    size_t in_pos;              // Next compressed byte to decode
+    size_t in_len;
+    int in_eof;
+    int boundary;               // Between gzip members or zstd frames: input may end here
+    char *ring;                 // DECODE_SLOTS buffers of DECODE_SLOT_SIZE bytes
+    size_t lengths[DECODE_SLOTS];
+    size_t produced;            // Slots filled so far (the next is produced % DECODE_SLOTS)
+    size_t consumed;            // Slots drained so far
+    size_t offset;              // Bytes already read from the slot being drained
+    int done;                   // No more slots will be filled
+    int failed;                 // Corrupt or truncated data: warn at the end
+    int stop;                   // The reader is gone
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       // A slot was filled, or decoding ended
+    pthread_cond_t room;        // A slot was drained, or stop was set
+    pthread_t thread;
+#ifdef HAVE_ZLIB
+    z_stream gzip;
+#endif
+#ifdef HAVE_LZMA
+    lzma_stream xz;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+} Decoder;
+
+// An opened input: regular files are mapped, everything else is streamed
+typedef struct {
+    int fd;
+    FILE *file;         // Set when the input is streamed through stdio
+    size_t size;        // Size of the file to map when file is NULL
+    int owned;          // Opened by us (a FILE argument), not stdin
+    InputFormat format;
+    Columns columns;
+    Decoder *decoder;   // Set when the input is compressed
+    unsigned char head[MAGIC_MAX];  // Read from a pipe to look for a magic number,
+    size_t head_len;                // and handed out first by read_available()
+} Input;
+
+// One thread's share of parallel_sort_double(): a slice of the input to
+// count and scatter, then one bucket to sort
+typedef struct {
+    double *values;
+    uint64_t *keys;             // Same memory as values, holding sort keys
+    uint64_t *tmp;              // Bucketed keys
+    const uint64_t *splitters;  // n_buckets - 1 ascending bucket bounds
+    int n_buckets;
+    size_t begin;               // Input slice
+    size_t end;
+    size_t *offsets;            // Per-bucket count, then scatter position
+    size_t bucket_begin;        // Bucket sorted by this thread
+    size_t bucket_end;
+    size_t (*radix_counts)[RADIX_BUCKETS];
+} SortJob;
+
+// Running moments of everything seen so far, in O(1) memory
+typedef struct {
+    size_t count;
+    double sum;
+    double mean;
+    double m2;          // Sum of squared deviations from the mean
+    double min;
+    double max;
+} Moments;
+
+// Computes the moments of one block of at most MOMENT_BLOCK values
+typedef void (*MomentsKernel)(const double *values, size_t n, Moments *out);
+
+// A t-digest cluster: the mean of `weight` nearby values
+typedef struct {
+    double mean;
+    double weight;
+} Centroid;
+
+// Mergeable t-digest (Dunning) for approximate quantiles in fixed memory.
+// Incoming values are buffered, then sorted and merged into the centroid
+// list whenever the buffer fills up.
+typedef struct {
+    double compression;
+    Centroid *centroids;    // Sorted by mean
+    size_t n_centroids;
+    size_t max_centroids;
+    double *buffer;         // Values not merged yet
+    size_t n_buffer;
+    size_t buffer_size;
+    Centroid *scratch;      // Merge workspace
+    double total;           // Weight of all merged centroids
+    double min;
+    double max;
+} TDigest;
+
+// HDR counts of one sign, by IEEE-754 exponent: octave e holds the
+// 2^sub_bits bucket counts for that power of two, allocated when its
+// first value arrives
+typedef struct {
+    uint64_t *counts[HDR_OCTAVES];
+    uint64_t totals[HDR_OCTAVES];   // Values per octave, so rank walks skip whole octaves
+} HdrSide;
+
+// High-dynamic-range histogram (after Gil Tene's HdrHistogram) over the
+// IEEE-754 bits of each value: the key of |x| is its exponent and top
+// sub_bits mantissa bits, so every power of two is split into 2^sub_bits
+// equal buckets and a bucket is never wider than 2^-sub_bits of its
+// values. Recording is a shift and an increment; no values are stored,
+// and two histograms with the same sub_bits merge by adding counts.
+typedef struct {
+    int sub_bits;
+    HdrSide positive;
+    HdrSide negative;       // Keyed by |x|
+    uint64_t zeros;         // Kept apart: 0 has no octave
+    uint64_t total;         // Values recorded (NaNs are skipped)
+} HdrHistogram;
+
+// Values staged per column before --all-columns folds them into the
+// column's moments (and t-digest)
+#define TABLE_BLOCK 256
+
+// Per-column accumulators for --all-columns, one entry per column in each
+// array. Values are staged column-major, TABLE_BLOCK slots per column, so
+// a row scatters into short contiguous runs and each full run goes through
+// the vector moments kernel at once.
+typedef struct {
+    char delim;             // 0 = runs of blanks
+    size_t n_columns;       // Widest row so far
+    size_t capacity;        // Columns allocated
+    double *staged;         // Column c at staged + c * TABLE_BLOCK
+    size_t *n_staged;
+    Moments *moments;
+    TDigest **digests;      // NULL unless --tdigest
+    double compression;
+    char **names;           // From the header line, NULL without one
+    size_t n_names;
+    int started;            // The first non-empty line has been seen
+    int non_numeric;        // Header check found a field that is not a number
+    int numeric;            // Header check found a field that is a number
+    int failed;             // Out of memory
+} Table;
+
+// Size of each block of group keys in an Arena
+#define ARENA_CHUNK (1 << 20)
+
+// Bump allocator for group keys: one malloc per ARENA_CHUNK, not per key
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;
+} Arena;
+
+// One --group-by slot. Slots live inline in the hash table; key is NULL
+// for an empty slot.
+typedef struct {
+    uint64_t hash;
+    const char *key;        // NUL-terminated, in the arena
+    size_t key_len;
+    Moments moments;
+    TDigest *digest;        // NULL unless --tdigest
+} Group;
+
+// Open-addressing (linear probing) hash table of groups. capacity is a
+// power of two and at most 3/4 of the slots are used.
+typedef struct {
+    Group *slots;
+    size_t capacity;
+    size_t n_groups;
+    Arena arena;
+    Columns key;            // Where the key is on each line
+    Columns value;          // Where the value is on each line
+    double compression;
+    int failed;             // Out of memory
+} GroupTable;
+
+// A window entry in a min or max deque: the value and its position
+typedef struct {
+    double value;
+    uint64_t seq;
+} DequeEntry;
+
+// Monotonic deque on a ring of capacity entries (at most one per value in
+// the window). Values increase from front to back for the minimum and
+// decrease for the maximum, so the front is always the extreme.
+typedef struct {
+    DequeEntry *items;
+    size_t capacity;
+    size_t head;
+    size_t len;
+} Deque;
+
+typedef struct SkipNode SkipNode;
+
+typedef struct {
+    SkipNode *next;
+    size_t width;       // Ranks advanced by following next (NULL = one past the end)
+} SkipLink;
+
+struct SkipNode {
+    double value;
+    uint64_t seq;       // Position in the input: makes every key distinct
+    int level;
+    SkipLink *links;    // level links, lowest first
+};
+
+// Indexable skiplist: a sorted multiset with O(log n) expected insert,
+// remove and select-by-rank. The nodes are allocated once, one per window
+// slot, and reused as values enter and leave.
+typedef struct {
+    SkipNode head;
+    SkipNode *nodes;
+    SkipLink *links;    // Pool for the links of head and nodes
+    int max_level;
+    size_t size;        // Values in the list
+    uint64_t random;    // xorshift state for node levels
+} SkipList;
+
+// --window state: the last size values in a ring buffer, their moments
+// kept by add/evict updates, and min/max deques
+typedef struct {
+    double *ring;
+    size_t size;
+    size_t pos;             // Ring slot of the next value
+    size_t count;           // Values in the window
+    uint64_t seen;          // Values read so far
+    double mean;
+    double m2;
+    size_t evictions;       // Since the moments were last recomputed
+    Deque min;
+    Deque max;
+    size_t every;
+    int json_output;
+    int precision;
+    SkipList *order;        // NULL unless --percentiles
+    SkipNode **slot_nodes;  // Node holding each ring slot's value
+    const double *percentiles;
+    size_t n_percentiles;
+} Window;
+
+// --time-col state. Buckets are tumbling windows of width seconds; only the
+// bucket the stream is in is held, and it is printed once a line from a
+// later bucket arrives.
+typedef struct {
+    Columns time;           // Where the timestamp is on each line
+    Columns value;          // Where the value is; column 0 = field after the time
+    long width;
+    int open;               // A bucket has values
+    int64_t index;          // Open bucket: start time / width
+    Moments moments;
+    TDigest *digest;        // NULL unless --tdigest
+    size_t late;            // Lines for buckets already printed (dropped)
+    int json_output;
+    int precision;
+} Buckets;
+
+// Everything one streaming pass accumulates
+typedef struct {
+    Moments moments;
+    TDigest *digest;        // NULL unless --tdigest
+    HdrHistogram *hdr;      // NULL unless --hdr
+} StreamState;
+
+// Cumulative snapshots while reading (--every, --interval, SIGUSR1). The
+// running state gives a Stats record at any time without touching the
+// values seen so far.
+typedef struct {
+    StreamState state;
+    ValueSink *inner;       // Also receives the values (exact mode), or NULL
+    size_t every;           // Report every this many values, 0 = off
+    size_t next_report;
+    int json_output;
+    int precision;
+    const double *percentiles;  // --percentiles, reported with --tdigest or --hdr
+    size_t n_percentiles;
+} Snapshots;
+
+// --hist/--log-hist: value counts in bins of equal width in the value (or
+// in its log2). Bin of x: (f(x) - offset) * scale, truncated and clamped
+// to the bins, with f the identity or hist_log2().
+typedef struct {
+    size_t bins;
+    int log_scale;
+    double lo;          // Lower edge of the first bin: minimum (positive minimum if log)
+    double hi;          // Upper edge of the last bin: the maximum
+    double offset;
+    double scale;       // 0 when lo == hi (then there is a single bin)
+    uint64_t *counts;   // bins + 1: the last slot counts values outside the
+                        // bins (NaN, and values <= 0 with log bins)
+} Histogram;
+
 // Statistics structure
 typedef struct {
+    int has_quantiles;  // Median/Q1/Q3 are only known when values are kept
+    double rank_error;  // Quantile rank error bound, NAN when exact
+    double value_error; // Quantile relative value error bound (--hdr), NAN otherwise
     size_t count;
     double sum;
     double mean;
@@ -23,58 +539,244 @@ typedef struct {
     double q3;
     double variance;
     double stddev;
+    size_t n_percentiles;   // --percentiles results, in the order asked
+    double percentiles[MAX_PERCENTILES];        // In percent
+    double percentile_values[MAX_PERCENTILES];
+    Histogram *histogram;   // NULL unless --hist
 } Stats;
 
 // Function prototypes
 void print_help(const char *program_name);
 void parse_args(int argc, char *argv[], Config *config);
-double* read_numbers(FILE *file, size_t *count);
+double* read_numbers(Input *input, size_t *count);
+double* read_numbers_mmap(int fd, size_t size, const Columns *columns, size_t *count, int threads);
+void* store_create(size_t expected);
+int store_grow(void **data, size_t bytes);
+size_t store_capacity(const void *data);
+void* store_alloc(size_t bytes);
+void store_free(void *data);
+size_t value_bound(const Input *input);
+int value_buffer_init(ValueBuffer *values, size_t expected);
+int float_buffer_init(FloatBuffer *values, size_t expected);
+int value_buffer_consume(void *ctx, const double *batch, size_t n);
+int float_buffer_consume(void *ctx, const double *batch, size_t n);
+float* read_floats(Input *input, const Config *config, size_t *count);
+ParseStatus parse_text(const char *p, const char *end, ValueSink *sink);
+ParseStatus parse_columns(const char *p, const char *end, const Columns *columns, ValueSink *sink);
+ParseStatus parse_lines(const char *p, const char *end, const Columns *columns, ValueSink *sink);
+ParseStatus read_blocks(Input *input, int by_line, BlockParser parse, void *ctx);
+ParseStatus parse_stream(Input *input, ValueSink *sink);
+char* map_input(int fd, size_t size);
+Compression detect_compression(const unsigned char *head, size_t n);
+Decoder* decoder_start(int fd, Compression kind, const unsigned char *head, size_t head_len);
+void decoder_free(Decoder *decoder);
+int open_input(const Config *config, Input *input);
+void close_input(Input *input);
+ParseStatus parse_input(Input *input, ValueSink *sink);
+size_t format_record_size(InputFormat format);
+ParseStatus parse_binary(const char *data, size_t size, InputFormat format, ValueSink *sink);
+ParseStatus parse_binary_stream(Input *input, ValueSink *sink);
+double* read_binary(Input *input, size_t *count);
+const double* map_f64le(Input *input, size_t *count);
+int stream_stats(Input *input, const Config *config, Stats *stats);
+int snapshots_wanted(const Config *config, const Input *input);
+ParseStatus parse_with_snapshots(Input *input, const Config *config, ValueSink *inner,
+                                 StreamState *state);
+void poll_snapshot(void);
+ParseStatus parse_table(const char *p, const char *end, void *ctx);
+int table_stats(Input *input, const Config *config);
+ParseStatus parse_input_lines(Input *input, BlockParser parse, void *ctx);
+char* arena_copy(Arena *arena, const char *str, size_t len);
+void arena_free(Arena *arena);
+Group* group_lookup(GroupTable *groups, const char *key, size_t len);
+ParseStatus parse_groups(const char *p, const char *end, void *ctx);
+int group_stats(Input *input, const Config *config);
+int window_consume(void *ctx, const double *values, size_t n);
+SkipList* skiplist_create(size_t capacity);
+void skiplist_free(SkipList *list);
+void skiplist_insert(SkipList *list, SkipNode *node);
+void skiplist_remove(SkipList *list, SkipNode *node);
+SkipNode* skiplist_select(SkipList *list, size_t rank);
+int window_stats(Input *input, const Config *config);
+const char* parse_timestamp(const char *p, const char *end, double *seconds);
+ParseStatus parse_buckets(const char *p, const char *end, void *ctx);
+int bucket_stats(Input *input, const Config *config);
+void print_bucket(Buckets *buckets);
+void print_window(Window *window);
+double* read_numbers_scanf(FILE *file, size_t *count);
+const char* parse_double(const char *p, const char *end, double *out);
+const char* parse_double_slow(const char *p, const char *end, double *out);
+int run_parse_benchmark(const char *path, int threads);
+void run_workers(void *(*worker)(void *), void *jobs, size_t job_size, int n);
+void moments_init(Moments *m);
+void moments_add(Moments *m, const double *values, size_t n);
+void moments_push(Moments *m, double value);
+void moments_merge(Moments *into, const Moments *other);
+void moments_reduce(const double *values, size_t n, int threads, Moments *out);
+void moments_add_float(Moments *m, const float *values, size_t n);
+void moments_reduce_float(const float *values, size_t n, int threads, Moments *out);
+void stats_from_moments(const Moments *m, Stats *stats);
+int stream_consume(void *ctx, const double *values, size_t n);
+TDigest* tdigest_create(double compression);
+void tdigest_free(TDigest *td);
+void tdigest_reset(TDigest *td);
+void tdigest_add(TDigest *td, const double *values, size_t n);
+double tdigest_percentile(TDigest *td, double percentile, double *rank_error);
+void stats_from_tdigest(TDigest *td, const double *percentiles, size_t n, Stats *stats);
+HdrHistogram* hdr_create(int sigfigs);
+void hdr_free(HdrHistogram *hdr);
+int hdr_add(HdrHistogram *hdr, const double *values, size_t n);
+double hdr_value_at_rank(const HdrHistogram *hdr, uint64_t rank);
+double hdr_percentile(const HdrHistogram *hdr, double percentile, double min, double max);
+void stats_from_hdr(const HdrHistogram *hdr, const double *percentiles, size_t n, Stats *stats);
 int compare_double(const void *a, const void *b);
-void calculate_stats(double *values, size_t count, Stats *stats);
+int radix_sort_double(double *values, size_t n);
+int parallel_sort_double(double *values, size_t n, int threads);
+void sort_doubles(double *values, size_t n, int threads);
+int compare_float(const void *a, const void *b);
+int radix_sort_float(float *values, size_t n);
+void sort_floats(float *values, size_t n);
+int run_sort_benchmark(size_t n, int threads);
+int calculate_stats(double *values, size_t count, Stats *stats, const Config *config);
+int calculate_stats_copy(const double *values, size_t count, Stats *stats, const Config *config);
+int calculate_stats_float(float *values, size_t count, Stats *stats, const Config *config);
+int histogram_compute(const double *values, const float *floats, size_t n, const Stats *stats,
+                      const Config *config, Histogram **out);
+void histogram_free(Histogram *h);
+double histogram_edge(const Histogram *h, size_t i);
+int percentile_rank(size_t count, double percentile, size_t *lower, double *weight);
 double get_percentile(double *sorted_values, size_t count, double percentile);
+void introselect(double *a, size_t n, size_t k);
+void multiselect(double *a, size_t n, const size_t *ranks, size_t n_ranks);
+void introselect_float(float *a, size_t n, size_t k);
+void multiselect_float(float *a, size_t n, const size_t *ranks, size_t n_ranks);
+double get_percentile_float(const float *sorted_values, size_t count, double percentile);
+size_t percentile_ranks(size_t count, const double *percentiles, size_t n, size_t *ranks);
 void print_stats_text(Stats *stats, int precision);
 void print_stats_json(Stats *stats, int precision);
+void print_table_text(Table *table, int precision);
+void print_table_json(Table *table, int precision);
+void print_groups_text(Group **groups, size_t n, int precision);
+void print_groups_json(Group **groups, size_t n, int precision);
 
 int main(int argc, char *argv[]) {
-    Config config = {0, 4, NULL};  // Default: text output, 4 decimals, no file
+    // Defaults: text output, 4 decimals, one thread, one-minute buckets;
+    // every other field is zero (off, or no FILE)
+    Config config = {
+        .precision = 4,
+        .io_mode = IO_AUTO,
+        .format = FORMAT_TEXT,
+        .threads = 1,
+        .bucket = 60,
+    };
 
     // Parse command-line arguments
     parse_args(argc, argv, &config);
 
-    // Determine input source
-    FILE *file;
-    if (config.input_file) {
-        file = fopen(config.input_file, "r");
-        if (!file) {
-            fprintf(stderr, "Error: Cannot open file '%s'\n", config.input_file);
+    if (config.bench_parse) {
+        if (!config.input_file) {
+            fprintf(stderr, "Error: --bench-parse requires a FILE argument\n");
             return 1;
         }
-    } else {
-        file = stdin;
+        return run_parse_benchmark(config.input_file, config.threads);
+    }
+    if (config.bench_sort) {
+        return run_sort_benchmark(config.bench_sort, config.threads);
+    }
+
+    // Determine input source
+    Input input;
+    if (open_input(&config, &input) != 0) {
+        return 1;
+    }
+
+    if (config.window || config.columns.time) {
+        int status = config.window ? window_stats(&input, &config)
+                                   : bucket_stats(&input, &config);
+        close_input(&input);
+        return status;
+    }
+    if (config.columns.all || config.columns.key) {
+        int status = config.columns.all ? table_stats(&input, &config)
+                                        : group_stats(&input, &config);
+        close_input(&input);
+        return status;
     }
 
-    // Read numbers from input
+    Stats stats;
     size_t count = 0;
-    double *values = read_numbers(file, &count);
+    double *values = NULL;
+    const double *mapped = NULL;    // f64le file used in place, read-only
+    float *floats = NULL;           // --float32 storage
+    int failed;
 
-    if (config.input_file) {
-        fclose(file);
+    if (config.stream || config.tdigest > 0 || config.hdr) {
+        // Fold every value into running moments (and the t-digest, if
+        // any) without storing it
+        failed = stream_stats(&input, &config, &stats) != 0;
+        count = stats.count;
+    } else if (config.float32) {
+        floats = read_floats(&input, &config, &count);
+        failed = floats == NULL;
+    } else if (config.format == FORMAT_F64LE && HOST_LITTLE_ENDIAN && !input.file &&
+               input.size >= sizeof(double)) {
+        // Records are already doubles: analyse the mapping as is
+        mapped = map_f64le(&input, &count);
+        failed = mapped == NULL;
+    } else if (config.format != FORMAT_TEXT) {
+        values = read_binary(&input, &count);
+        failed = values == NULL;
+    } else if (snapshots_wanted(&config, &input)) {
+        // Collect the values while keeping running moments for snapshots
+        ValueBuffer buffer;
+        StreamState state;
+        state.digest = NULL;
+        state.hdr = NULL;
+        failed = value_buffer_init(&buffer, value_bound(&input)) != 0;
+        ValueSink sink = {value_buffer_consume, &buffer};
+        if (!failed && parse_with_snapshots(&input, &config, &sink, &state) == PARSE_NOMEM) {
+            store_free(buffer.data);
+            failed = 1;
+        }
+        if (!failed) {
+            values = buffer.data;
+            count = buffer.count;
+        }
+    } else {
+        // Read numbers from input
+        values = input.file ? read_numbers(&input, &count)
+                            : read_numbers_mmap(input.fd, input.size, &config.columns, &count,
+                                                config.threads);
+        failed = values == NULL;
     }
+    close_input(&input);
 
-    if (!values) {
+    if (failed) {
         fprintf(stderr, "Error: Memory allocation failed\n");
         return 1;
     }
 
     if (count == 0) {
         fprintf(stderr, "Error: No valid numbers found in input\n");
-        free(values);
+        store_free(values);
+        store_free(floats);
         return 1;
     }
 
     // Calculate statistics
-    Stats stats;
-    calculate_stats(values, count, &stats);
+    // Values read into memory are ours to reorder; only the mapping is
+    // copied first
+    if ((values && calculate_stats(values, count, &stats, &config) != 0) ||
+        (mapped && calculate_stats_copy(mapped, count, &stats, &config) != 0) ||
+        (floats && calculate_stats_float(floats, count, &stats, &config) != 0)) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        store_free(values);
+        store_free(floats);
+        if (mapped) {
+            munmap((void *)mapped, input.size);
+        }
+        return 1;
+    }
 
     // Print results
     if (config.json_output) {
@@ -83,7 +785,12 @@ int main(int argc, char *argv[]) {
         print_stats_text(&stats, config.precision);
     }
 
-    free(values);
+    histogram_free(stats.histogram);
+    store_free(values);
+    store_free(floats);
+    if (mapped) {
+        munmap((void *)mapped, input.size);
+    }
     return 0;
 }
 
@@ -93,10 +800,45 @@ void print_help(const char *program_name) {
     printf("Options:\n");
     printf("  -j, --json         Output in JSON format\n");
     printf("  -p, --precision N  Set decimal precision (default: 4)\n");
+    printf("  -t, --threads N    Worker threads, 0 = one per CPU (default: 1)\n");
+    printf("  -c, --column N     Read only field N (from 1) of each line\n");
+    printf("  -d, --delimiter C  Field separator for -c (default: runs of blanks)\n");
+    printf("  --all-columns      Statistics for every column (-d sets the separator);\n");
+    printf("                     median and quartiles need --tdigest\n");
+    printf("  --group-by N       Statistics per distinct value of field N; the value\n");
+    printf("                     is field N + 1 unless -c is given\n");
+    printf("  --window N         Rolling mean, stddev, min and max of the last N values\n");
+    printf("  --every K          Print the statistics so far every K values (with\n");
+    printf("                     --window: report the window every K values)\n");
+    printf("  --interval S       Print the statistics so far every S seconds\n");
+    printf("  --percentiles L    Also report these percentiles, e.g. 50,90,99,99.9\n");
+    printf("  --time-col N       Statistics per time bucket of the timestamp in field\n");
+    printf("                     N (epoch or ISO-8601); the value is the next field\n");
+    printf("                     unless -c is given\n");
+    printf("  --bucket W         Bucket width for --time-col: 1s, 10s, 1m, 1h... (default: 1m)\n");
+    printf("  --hist N           Histogram of N bins of equal width from min to max\n");
+    printf("  --log-hist         Make the bins equally wide in log(value), for data\n");
+    printf("                     spanning orders of magnitude (default: 10 bins)\n");
+    printf("  --format F         Input format: text (default), or raw little-endian\n");
+    printf("                     records f64le, f32le, i64le, i32le\n");
+    printf("  --stream           Constant memory: skip median and quartiles\n");
+    printf("  --tdigest C        Constant memory, approximate median and quartiles\n");
+    printf("                     from a t-digest with compression C (e.g. 100)\n");
+    printf("  --hdr D            Constant-time recording into an HDR histogram with D\n");
+    printf("                     significant digits (1-5): median, quartiles and\n");
+    printf("                     --percentiles within a relative error of 10^-D\n");
+    printf("  --float32          Keep the values as 4-byte floats: half the memory,\n");
+    printf("                     float precision (sums and moments stay in double)\n");
+    printf("  --mmap             Always memory-map the input (regular files only)\n");
+    printf("  --no-mmap          Always read the input through stdio\n");
+    printf("  --sort             Fully sort the values instead of selecting quartiles\n");
+    printf("  --bench-parse      Benchmark the number parser against fscanf on FILE\n");
+    printf("  --bench-sort N     Benchmark radix sort against qsort on N values\n");
     printf("  -h, --help         Show this help message\n\n");
     printf("Input:\n");
     printf("  If FILE is provided, reads numbers from file\n");
-    printf("  If no FILE is given, reads from stdin\n\n");
+    printf("  If no FILE is given, reads from stdin\n");
+    printf("  gzip, xz and zstd input is decompressed on the fly\n\n");
     printf("Statistics calculated:\n");
     printf("  - Count, Sum, Mean, Median\n");
     printf("  - Minimum, Maximum, Range\n");
@@ -128,6 +870,235 @@ void parse_args(int argc, char *argv[], Config *config) {
                 fprintf(stderr, "Error: -p requires a number argument\n");
                 exit(1);
             }
+        } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0) {
+            if (i + 1 < argc) {
+                config->threads = atoi(argv[++i]);
+                if (config->threads <= 0) {
+                    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                    config->threads = cpus > 0 ? (int)cpus : 1;
+                }
+            } else {
+                fprintf(stderr, "Error: -t requires a number argument\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--format") == 0) {
+            if (i + 1 < argc) {
+                const char *name = argv[++i];
+                if (strcmp(name, "text") == 0) {
+                    config->format = FORMAT_TEXT;
+                } else if (strcmp(name, "f64le") == 0) {
+                    config->format = FORMAT_F64LE;
+                } else if (strcmp(name, "f32le") == 0) {
+                    config->format = FORMAT_F32LE;
+                } else if (strcmp(name, "i64le") == 0) {
+                    config->format = FORMAT_I64LE;
+                } else if (strcmp(name, "i32le") == 0) {
+                    config->format = FORMAT_I32LE;
+                } else {
+                    fprintf(stderr, "Error: Unknown format '%s' (text, f64le, f32le, i64le or i32le)\n", name);
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr, "Error: --format requires a format name\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--column") == 0 ||
+                   strncmp(argv[i], "-c", 2) == 0) {
+            // Also accepts the attached form of cut(1), e.g. -c2
+            const char *arg = argv[i][1] == 'c' && argv[i][2] ? argv[i] + 2 : NULL;
+            if (arg || i + 1 < argc) {
+                config->columns.column = atoi(arg ? arg : argv[++i]);
+                if (config->columns.column < 1) {
+                    fprintf(stderr, "Error: Column numbers start at 1\n");
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr, "Error: -c requires a column number\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--delimiter") == 0 ||
+                   strncmp(argv[i], "-d", 2) == 0) {
+            // Also accepts the attached form of cut(1), e.g. -d,
+            const char *arg = argv[i][1] == 'd' && argv[i][2] ? argv[i] + 2 : NULL;
+            if (arg || i + 1 < argc) {
+                const char *delim = arg ? arg : argv[++i];
+                if (strcmp(delim, "\\t") == 0 || strcmp(delim, "tab") == 0) {
+                    config->columns.delim = '\t';
+                } else if (strlen(delim) == 1 && delim[0] != '\n') {
+                    config->columns.delim = delim[0];
+                } else {
+                    fprintf(stderr, "Error: -d requires a single character (or '\\t')\n");
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr, "Error: -d requires a delimiter argument\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--group-by") == 0) {
+            if (i + 1 < argc) {
+                config->columns.key = atoi(argv[++i]);
+                if (config->columns.key < 1) {
+                    fprintf(stderr, "Error: Column numbers start at 1\n");
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr, "Error: --group-by requires a column number\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--window") == 0) {
+            if (i + 1 < argc) {
+                long n = atol(argv[++i]);
+                if (n < 1) {
+                    fprintf(stderr, "Error: --window needs a positive number of values\n");
+                    exit(1);
+                }
+                config->window = (size_t)n;
+            } else {
+                fprintf(stderr, "Error: --window requires a number argument\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--every") == 0) {
+            if (i + 1 < argc) {
+                long n = atol(argv[++i]);
+                if (n < 1) {
+                    fprintf(stderr, "Error: --every needs a positive number of values\n");
+                    exit(1);
+                }
+                config->every = (size_t)n;
+            } else {
+                fprintf(stderr, "Error: --every requires a number argument\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--percentiles") == 0) {
+            if (i + 1 < argc) {
+                const char *p = argv[++i];
+                config->n_percentiles = 0;
+                while (*p) {
+                    char *next;
+                    double percent = strtod(p, &next);
+                    if (next == p || (*next && *next != ',') || !(percent >= 0 && percent <= 100)) {
+                        fprintf(stderr, "Error: --percentiles needs a list like 50,90,99.9 (0 to 100)\n");
+                        exit(1);
+                    }
+                    if (config->n_percentiles == MAX_PERCENTILES) {
+                        fprintf(stderr, "Error: At most %d percentiles\n", MAX_PERCENTILES);
+                        exit(1);
+                    }
+                    config->percentiles[config->n_percentiles++] = percent;
+                    p = *next ? next + 1 : next;
+                }
+                if (config->n_percentiles == 0) {
+                    fprintf(stderr, "Error: --percentiles needs a list like 50,90,99.9 (0 to 100)\n");
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr, "Error: --percentiles requires a list argument\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--time-col") == 0) {
+            if (i + 1 < argc) {
+                config->columns.time = atoi(argv[++i]);
+                if (config->columns.time < 1) {
+                    fprintf(stderr, "Error: Column numbers start at 1\n");
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr, "Error: --time-col requires a column number\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--bucket") == 0) {
+            if (i + 1 < argc) {
+                char *unit;
+                const char *arg = argv[++i];
+                long width = strtol(arg, &unit, 10);
+                if (strcmp(unit, "m") == 0) {
+                    width *= 60;
+                } else if (strcmp(unit, "h") == 0) {
+                    width *= 3600;
+                } else if (strcmp(unit, "d") == 0) {
+                    width *= 86400;
+                } else if (strcmp(unit, "s") != 0 && *unit) {
+                    width = 0;
+                }
+                if (unit == arg || width < 1) {
+                    fprintf(stderr, "Error: --bucket needs a duration like 1s, 10s, 1m or 1h\n");
+                    exit(1);
+                }
+                config->bucket = width;
+            } else {
+                fprintf(stderr, "Error: --bucket requires a duration argument\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--interval") == 0) {
+            if (i + 1 < argc) {
+                config->interval = atof(argv[++i]);
+                if (!(config->interval >= 0.001)) {
+                    fprintf(stderr, "Error: --interval needs a number of seconds (at least 0.001)\n");
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr, "Error: --interval requires a number of seconds\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--hist") == 0) {
+            if (i + 1 < argc) {
+                long n = atol(argv[++i]);
+                if (n < 1 || n > MAX_HIST_BINS) {
+                    fprintf(stderr, "Error: --hist needs a number of bins from 1 to %d\n",
+                            MAX_HIST_BINS);
+                    exit(1);
+                }
+                config->hist_bins = (size_t)n;
+            } else {
+                fprintf(stderr, "Error: --hist requires a number of bins\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--log-hist") == 0) {
+            config->log_hist = 1;
+        } else if (strcmp(argv[i], "--all-columns") == 0) {
+            config->columns.all = 1;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            config->stream = 1;
+        } else if (strcmp(argv[i], "--tdigest") == 0) {
+            if (i + 1 < argc) {
+                config->tdigest = atof(argv[++i]);
+                if (config->tdigest < 10 || config->tdigest > 10000) {
+                    fprintf(stderr, "Warning: Compression should be between 10 and 10000. Using 100.\n");
+                    config->tdigest = 100;
+                }
+            } else {
+                fprintf(stderr, "Error: --tdigest requires a number argument\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--hdr") == 0) {
+            if (i + 1 < argc) {
+                config->hdr = atoi(argv[++i]);
+                if (config->hdr < 1 || config->hdr > HDR_MAX_SIGFIGS) {
+                    fprintf(stderr, "Error: --hdr needs 1 to %d significant digits\n",
+                            HDR_MAX_SIGFIGS);
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr, "Error: --hdr requires a number of significant digits\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--float32") == 0) {
+            config->float32 = 1;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            config->io_mode = IO_MMAP;
+        } else if (strcmp(argv[i], "--no-mmap") == 0) {
+            config->io_mode = IO_STREAM;
+        } else if (strcmp(argv[i], "--sort") == 0) {
+            config->full_sort = 1;
+        } else if (strcmp(argv[i], "--bench-parse") == 0) {
+            config->bench_parse = 1;
+        } else if (strcmp(argv[i], "--bench-sort") == 0) {
+            if (i + 1 < argc && atol(argv[i + 1]) > 0) {
+                config->bench_sort = (size_t)atol(argv[++i]);
+            } else {
+                fprintf(stderr, "Error: --bench-sort requires a positive number argument\n");
+                exit(1);
+            }
         } else if (argv[i][0] == '-') {
             fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
             fprintf(stderr, "Use -h or --help for usage information\n");
@@ -141,128 +1112,4947 @@ void parse_args(int argc, char *argv[], Config *config) {
             config->input_file = argv[i];
         }
     }
-}
 
-double* read_numbers(FILE *file, size_t *count) {
-    double *values = NULL;
-    size_t capacity = 16;  // Start with reasonable capacity
-    *count = 0;
-    double num;
-
-    values = malloc(capacity * sizeof(double));
-    if (!values) {
-        return NULL;
+    if (config->columns.delim && !config->columns.column && !config->columns.all &&
+        !config->columns.key && !config->columns.time) {
+        fprintf(stderr, "Error: -d requires -c, --all-columns, --group-by or --time-col\n");
+        exit(1);
     }
-
-    // Read numbers from file/stdin
-    while (fscanf(file, "%lf", &num) == 1) {
-        if (*count >= capacity) {
-            capacity *= 2;
-            double *new_values = realloc(values, capacity * sizeof(double));
-            if (!new_values) {
-                free(values);
-                return NULL;
-            }
-            values = new_values;
-        }
-        values[(*count)++] = num;
+    if (config->columns.time && (config->window || config->columns.all || config->columns.key)) {
+        fprintf(stderr, "Error: --time-col cannot be combined with --window, --all-columns "
+                        "or --group-by\n");
+        exit(1);
+    }
+    if (config->columns.all && (config->columns.column || config->columns.key)) {
+        fprintf(stderr, "Error: --all-columns cannot be combined with -c or --group-by\n");
+        exit(1);
+    }
+    if ((config->columns.column || config->columns.all || config->columns.key ||
+         config->columns.time) && config->format != FORMAT_TEXT) {
+        fprintf(stderr, "Error: -c, --all-columns, --group-by and --time-col only apply to "
+                        "text input\n");
+        exit(1);
+    }
+    if (config->window && (config->columns.all || config->columns.key)) {
+        fprintf(stderr, "Error: --window cannot be combined with --all-columns or --group-by\n");
+        exit(1);
+    }
+    if (config->hdr && (config->tdigest > 0 || config->window || config->columns.all ||
+                        config->columns.key || config->columns.time)) {
+        fprintf(stderr, "Error: --hdr cannot be combined with --tdigest, --window, "
+                        "--all-columns, --group-by or --time-col\n");
+        exit(1);
+    }
+    if (config->n_percentiles > 0 && (config->columns.all || config->columns.key ||
+                                      config->columns.time)) {
+        fprintf(stderr, "Error: --percentiles cannot be combined with --all-columns, "
+                        "--group-by or --time-col\n");
+        exit(1);
     }
+    if (config->n_percentiles > 0 && config->stream && !config->tdigest && !config->hdr) {
+        fprintf(stderr, "Error: --percentiles needs the values: use --tdigest or --hdr "
+                        "instead of --stream\n");
+        exit(1);
+    }
+    if (config->float32 && (config->stream || config->tdigest > 0 || config->hdr ||
+                            config->window || config->columns.all || config->columns.key ||
+                            config->columns.time)) {
+        fprintf(stderr, "Error: --float32 only applies when the values are kept in memory, "
+                        "not with --stream, --tdigest, --hdr, --window, --all-columns, "
+                        "--group-by or --time-col\n");
+        exit(1);
+    }
+    if (config->log_hist && !config->hist_bins) {
+        config->hist_bins = 10;
+    }
+    if (config->hist_bins && (config->stream || config->tdigest > 0 || config->hdr ||
+                              config->window ||
+                              config->columns.all || config->columns.key ||
+                              config->columns.time)) {
+        fprintf(stderr, "Error: --hist needs the values in memory: it cannot be combined with "
+                        "--stream, --tdigest, --hdr, --window, --all-columns, --group-by or "
+                        "--time-col\n");
+        exit(1);
+    }
+    if (config->columns.key && !config->columns.column) {
+        config->columns.column = config->columns.key + 1;  // Value follows the key
+    }
+}
 
-    return values;
+// Exact powers of ten representable in a double (Clinger's fast path)
+static const double POW10_EXACT[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Same character set fscanf() skips before a number
+static inline int is_space_char(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
 }
 
-int compare_double(const void *a, const void *b) {
-    double diff = (*(double*)a - *(double*)b);
-    return (diff > 0) - (diff < 0);  // Returns -1, 0, or 1
+// Where a text input can be cut without splitting a token (or, when a
+// column is selected, a line)
+static inline int is_cut_char(char c, const Columns *columns) {
+    return columns->column || columns->all ? c == '\n' : is_space_char(c);
 }
 
-double get_percentile(double *sorted_values, size_t count, double percentile) {
-    if (count == 0) return 0.0;
-    if (count == 1) return sorted_values[0];
+static inline int is_digit_char(char c) {
+    return (unsigned char)(c - '0') < 10;
+}
 
-    double index = percentile * (count - 1);
-    size_t lower = (size_t)index;
-    size_t upper = lower + 1;
+// Parse one number starting at p (which must not be whitespace) without
+// reading past end. Returns the position after the number, or NULL if p
+// does not start a number. Mantissas of up to 19 digits with an exponent
+// in [-22, 22] are computed exactly with a single IEEE multiply or divide;
+// everything else is handed to strtod(), so results always match strtod().
+const char* parse_double(const char *p, const char *end, double *out) {
+    const char *start = p;
+    int negative = 0;
 
-    if (upper >= count) {
-        return sorted_values[count - 1];
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
     }
 
-    double weight = index - lower;
-    return sorted_values[lower] * (1 - weight) + sorted_values[upper] * weight;
-}
+    // Hex floats are rare enough to leave to strtod
+    if (end - p >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        return parse_double_slow(start, end, out);
+    }
 
-void calculate_stats(double *values, size_t count, Stats *stats) {
-    stats->count = count;
-    stats->sum = 0.0;
-    stats->min = values[0];
-    stats->max = values[0];
+    uint64_t mantissa = 0;
+    int digits = 0;       // Significant digits accumulated in mantissa
+    int exponent = 0;     // Decimal exponent applied to mantissa
+    int seen_digit = 0;
 
-    // Calculate sum, min, max
-    for (size_t i = 0; i < count; i++) {
-        stats->sum += values[i];
-        if (values[i] < stats->min) stats->min = values[i];
-        if (values[i] > stats->max) stats->max = values[i];
+    while (p < end && *p == '0') {
+        p++;
+        seen_digit = 1;
+    }
+    while (p < end && is_digit_char(*p)) {
+        if (digits == 19) {
+            return parse_double_slow(start, end, out);
+        }
+        mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        digits++;
+        seen_digit = 1;
+        p++;
     }
 
-    stats->mean = stats->sum / count;
-    stats->range = stats->max - stats->min;
-
-    // Calculate variance and standard deviation
-    stats->variance = 0.0;
-    for (size_t i = 0; i < count; i++) {
-        double diff = values[i] - stats->mean;
-        stats->variance += diff * diff;
+    if (p < end && *p == '.') {
+        p++;
+        if (mantissa == 0) {
+            while (p < end && *p == '0') {
+                exponent--;
+                seen_digit = 1;
+                p++;
+            }
+        }
+        while (p < end && is_digit_char(*p)) {
+            if (digits == 19) {
+                return parse_double_slow(start, end, out);
+            }
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            digits++;
+            exponent--;
+            seen_digit = 1;
+            p++;
+        }
     }
-    stats->variance /= count;
-    stats->stddev = sqrt(stats->variance);
 
-    // Create a copy for sorting to preserve original order
-    double *sorted_values = malloc(count * sizeof(double));
-    if (!sorted_values) {
-        // Fallback: use original array if allocation fails
-        qsort(values, count, sizeof(double), compare_double);
-        sorted_values = values;
-    } else {
-        memcpy(sorted_values, values, count * sizeof(double));
-        qsort(sorted_values, count, sizeof(double), compare_double);
+    // inf, nan, lone signs/dots and non-numeric tokens
+    if (!seen_digit) {
+        return parse_double_slow(start, end, out);
     }
 
-    // Calculate median and quartiles
-    stats->median = get_percentile(sorted_values, count, 0.50);
-    stats->q1 = get_percentile(sorted_values, count, 0.25);
-    stats->q3 = get_percentile(sorted_values, count, 0.75);
+    // fscanf() reads "4.5e" as 4.5 and swallows the dangling exponent
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        int exp_negative = 0;
+        if (q < end && (*q == '-' || *q == '+')) {
+            exp_negative = (*q == '-');
+            q++;
+        }
+        if (q < end && is_digit_char(*q)) {
+            int exp_value = 0;
+            while (q < end && is_digit_char(*q)) {
+                if (exp_value < 100000) {
+                    exp_value = exp_value * 10 + (*q - '0');
+                }
+                q++;
+            }
+            exponent += exp_negative ? -exp_value : exp_value;
+        }
+        p = q;
+    }
 
-    // Free sorted copy if we allocated it
-    if (sorted_values != values) {
-        free(sorted_values);
+    double value;
+    if (mantissa == 0) {
+        value = 0.0;
+    } else if (FLT_EVAL_METHOD == 0 && mantissa <= (1ULL << 53) &&
+               exponent >= -22 && exponent <= 22) {
+        value = (double)mantissa;
+        value = exponent < 0 ? value / POW10_EXACT[-exponent]
+                             : value * POW10_EXACT[exponent];
+    } else {
+        return parse_double_slow(start, end, out);
     }
+
+    *out = negative ? -value : value;
+    return p;
 }
 
-void print_stats_text(Stats *stats, int precision) {
+// Exact fallback: copy the whitespace-delimited token into a NUL-terminated
+// buffer and let strtod() do the work.
+const char* parse_double_slow(const char *p, const char *end, double *out) {
+    size_t len = 0;
+    while (p + len < end && !is_space_char(p[len])) {
+        len++;
+    }
+    if (len == 0) {
+        return NULL;
+    }
+
+    char stack_buf[SLOW_TOKEN_MAX];
+    char *buf = stack_buf;
+    if (len >= sizeof(stack_buf)) {
+        buf = malloc(len + 1);
+        if (!buf) {
+            return NULL;
+        }
+    }
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+
+    char *stop;
+    *out = strtod(buf, &stop);
+    size_t used = (size_t)(stop - buf);
+
+    // Swallow a dangling exponent after decimal digits, as fscanf() does
+    if (used > 0 && (*stop == 'e' || *stop == 'E') &&
+        (is_digit_char(stop[-1]) || stop[-1] == '.')) {
+        used++;
+        if (buf[used] == '-' || buf[used] == '+') {
+            used++;
+        }
+    }
+
+    if (buf != stack_buf) {
+        free(buf);
+    }
+    return used ? p + used : NULL;
+}
+
+static StoreHeader* store_header(const void *data) {
+    return (StoreHeader *)(void *)((char *)data - STORE_HEADER);
+}
+
+// Memory for an array of values that grows without moving: a range of
+// address space big enough for expected bytes (0 = unknown, then a very
+// large range) is reserved, aligned for transparent huge pages, and made
+// usable a segment at a time by store_grow(). Untouched pages cost
+// nothing, so the reservation can be generous. Where address space cannot
+// be reserved this falls back to malloc() and realloc(). Returns a pointer
+// to the values, to be released with store_free(), or NULL.
+void* store_create(size_t expected) {
+    size_t reserved = expected ? expected + STORE_HEADER : STORE_RESERVE_UNKNOWN;
+    reserved = (reserved + STORE_ALIGN - 1) & ~(size_t)(STORE_ALIGN - 1);
+    size_t committed = reserved < STORE_SEGMENT ? reserved : STORE_SEGMENT;
+    char *base = NULL;
+
+    char *range = mmap(NULL, reserved + STORE_ALIGN, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (range != MAP_FAILED) {
+        // Trim the slack that made room for aligning the start
+        base = (char *)(((uintptr_t)range + STORE_ALIGN - 1) & ~(uintptr_t)(STORE_ALIGN - 1));
+        if (base > range) {
+            munmap(range, (size_t)(base - range));
+        }
+        munmap(base + reserved, (size_t)(range + STORE_ALIGN - base));
+        if (mprotect(base, committed, PROT_READ | PROT_WRITE) != 0) {
+            munmap(base, reserved);
+            base = NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (base) {
+            madvise(base, reserved, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    if (!base) {
+        reserved = 0;
+        committed = STORE_HEADER + 16 * sizeof(double);
+        base = malloc(committed);
+        if (!base) {
+            return NULL;
+        }
+    }
+
+    StoreHeader *header = (StoreHeader *)(void *)base;
+    header->reserved = reserved;
+    header->committed = committed;
+    return base + STORE_HEADER;
+}
+
+// Make room for at least bytes of values in the store at *data. Reserved
+// stores grow in place; only a malloc() fallback, or a store outgrowing
+// its reservation, moves (and *data is updated). Returns -1, leaving the
+// store as it was, if out of memory.
+int store_grow(void **data, size_t bytes) {
+    StoreHeader *header = store_header(*data);
+    size_t need = bytes + STORE_HEADER;
+    if (need <= header->committed) {
+        return 0;
+    }
+
+    if (header->reserved == 0) {
+        size_t size = header->committed;
+        while (size < need) {
+            size *= 2;
+        }
+        StoreHeader *grown = realloc(header, size);
+        if (!grown) {
+            return -1;
+        }
+        grown->committed = size;
+        *data = (char *)grown + STORE_HEADER;
+        return 0;
+    }
+
+    if (need > header->reserved) {
+        // Past the reservation: move to one twice as large (the only copy)
+        size_t expected = header->reserved * 2 > need ? header->reserved * 2 : need;
+        void *bigger = store_create(expected);
+        if (!bigger) {
+            return -1;
+        }
+        if (store_grow(&bigger, bytes) != 0) {
+            store_free(bigger);
+            return -1;
+        }
+        memcpy(bigger, *data, header->committed - STORE_HEADER);
+        store_free(*data);
+        *data = bigger;
+        return 0;
+    }
+
+    size_t committed = header->committed + STORE_SEGMENT;
+    if (committed < need) {
+        committed = (need + STORE_ALIGN - 1) & ~(size_t)(STORE_ALIGN - 1);
+    }
+    if (committed > header->reserved) {
+        committed = header->reserved;
+    }
+    if (mprotect((char *)header + header->committed, committed - header->committed,
+                 PROT_READ | PROT_WRITE) != 0) {
+        return -1;
+    }
+    header->committed = committed;
+    return 0;
+}
+
+// Bytes of values the store holds without growing
+size_t store_capacity(const void *data) {
+    return store_header(data)->committed - STORE_HEADER;
+}
+
+// A store with room for bytes of values from the start
+void* store_alloc(size_t bytes) {
+    void *data = store_create(bytes);
+    if (data && store_grow(&data, bytes) != 0) {
+        store_free(data);
+        return NULL;
+    }
+    return data;
+}
+
+void store_free(void *data) {
+    if (!data) {
+        return;
+    }
+    StoreHeader *header = store_header(data);
+    if (header->reserved) {
+        munmap(header, header->reserved);
+    } else {
+        free(header);
+    }
+}
+
+// Most values a regular file can hold (text needs at least a digit and a
+// separator per number), to size value stores up front; 0 if the input
+// is not a regular file or is compressed
+size_t value_bound(const Input *input) {
+    struct stat st;
+    if (input->decoder || fstat(input->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    size_t record = format_record_size(input->format);
+    return record ? (size_t)st.st_size / record : (size_t)st.st_size / 2 + 1;
+}
+
+// Empty buffer in a value store sized for expected values (0 = unknown)
+int value_buffer_init(ValueBuffer *values, size_t expected) {
+    values->count = 0;
+    values->data = store_create(expected * sizeof(double));
+    if (!values->data) {
+        return -1;
+    }
+    values->capacity = store_capacity(values->data) / sizeof(double);
+    return 0;
+}
+
+int float_buffer_init(FloatBuffer *values, size_t expected) {
+    values->count = 0;
+    values->data = store_create(expected * sizeof(float));
+    if (!values->data) {
+        return -1;
+    }
+    values->capacity = store_capacity(values->data) / sizeof(float);
+    return 0;
+}
+
+// ValueSink callback: append a batch, growing the store as needed
+int value_buffer_consume(void *ctx, const double *batch, size_t n) {
+    ValueBuffer *values = ctx;
+    if (values->count + n > values->capacity) {
+        void *data = values->data;
+        if (store_grow(&data, (values->count + n) * sizeof(double)) != 0) {
+            return -1;
+        }
+        values->data = data;
+        values->capacity = store_capacity(data) / sizeof(double);
+    }
+    memcpy(values->data + values->count, batch, n * sizeof(double));
+    values->count += n;
+    return 0;
+}
+
+// ValueSink callback for --float32: append a batch narrowed to float
+int float_buffer_consume(void *ctx, const double *batch, size_t n) {
+    FloatBuffer *values = ctx;
+    if (values->count + n > values->capacity) {
+        void *data = values->data;
+        if (store_grow(&data, (values->count + n) * sizeof(float)) != 0) {
+            return -1;
+        }
+        values->data = data;
+        values->capacity = store_capacity(data) / sizeof(float);
+    }
+    for (size_t i = 0; i < n; i++) {
+        values->data[values->count + i] = (float)batch[i];
+    }
+    values->count += n;
+    return 0;
+}
+
+// Parse every whitespace-separated number in [p, end) and hand them to
+// the sink in batches of PARSE_BATCH
+ParseStatus parse_text(const char *p, const char *end, ValueSink *sink) {
+    double batch[PARSE_BATCH];
+    size_t n = 0;
+    ParseStatus status = PARSE_END;
+
+    while (1) {
+        while (p < end && is_space_char(*p)) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        const char *next = parse_double(p, end, &batch[n]);
+        if (!next) {
+            status = PARSE_STOP;
+            break;
+        }
+        p = next;
+
+        if (++n == PARSE_BATCH) {
+            if (sink->consume(sink->ctx, batch, n) != 0) {
+                return PARSE_NOMEM;
+            }
+            n = 0;
+        }
+    }
+
+    if (n > 0 && sink->consume(sink->ctx, batch, n) != 0) {
+        return PARSE_NOMEM;
+    }
+    return status;
+}
+
+static inline int is_blank_char(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Find field number columns->column in the line [p, eol) and store its end
+// in *field_end. Fields before it are skipped with memchr() (or a blank
+// scan) and never converted. Returns NULL if the line is too short.
+static const char* find_field(const char *p, const char *eol, const Columns *columns,
+                              const char **field_end) {
+    if (columns->delim) {
+        for (int i = 1; i < columns->column; i++) {
+            p = memchr(p, columns->delim, (size_t)(eol - p));
+            if (!p) {
+                return NULL;
+            }
+            p++;
+        }
+        const char *q = memchr(p, columns->delim, (size_t)(eol - p));
+        *field_end = q ? q : eol;
+        return p;
+    }
+
+    for (int i = 1; ; i++) {
+        while (p < eol && is_blank_char(*p)) {
+            p++;
+        }
+        if (p == eol) {
+            return NULL;
+        }
+        const char *q = p;
+        while (q < eol && !is_blank_char(*q)) {
+            q++;
+        }
+        if (i == columns->column) {
+            *field_end = q;
+            return p;
+        }
+        p = q;
+    }
+}
+
+// Parse a field that must hold exactly one number, give or take blanks.
+// Returns 0 for empty and non-numeric fields.
+static int parse_field(const char *field, const char *field_end, double *out) {
+    while (field < field_end && is_blank_char(*field)) {
+        field++;
+    }
+    while (field_end > field && is_blank_char(field_end[-1])) {
+        field_end--;
+    }
+    return field < field_end && parse_double(field, field_end, out) == field_end;
+}
+
+// Parse the selected field of every line in [p, end). Lines where the field
+// is missing or is not a single number (headers, blanks) are skipped.
+ParseStatus parse_columns(const char *p, const char *end, const Columns *columns, ValueSink *sink) {
+    double batch[PARSE_BATCH];
+    size_t n = 0;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) {
+            eol = end;
+        }
+
+        const char *field_end;
+        const char *field = find_field(p, eol, columns, &field_end);
+        if (field && parse_field(field, field_end, &batch[n]) && ++n == PARSE_BATCH) {
+            if (sink->consume(sink->ctx, batch, n) != 0) {
+                return PARSE_NOMEM;
+            }
+            n = 0;
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+
+    if (n > 0 && sink->consume(sink->ctx, batch, n) != 0) {
+        return PARSE_NOMEM;
+    }
+    return PARSE_END;
+}
+
+// Parse [p, end) as whole tokens, or as lines when a column is selected
+ParseStatus parse_lines(const char *p, const char *end, const Columns *columns, ValueSink *sink) {
+    return columns->column ? parse_columns(p, end, columns, sink) : parse_text(p, end, sink);
+}
+
+static size_t decoder_read(Decoder *d, char *buf, size_t n);
+
+// read(2) as much as is available, up to n bytes. A signal (a snapshot
+// request) interrupts the wait: the snapshot is printed and reading goes on.
+// Compressed input comes from the decoder thread instead, and the bytes
+// open_input() looked at for a magic number come first.
+// Returns 0 at end of input or on a read error.
+static size_t read_available(Input *input, char *buf, size_t n) {
+    if (input->head_len > 0) {
+        size_t take = n < input->head_len ? n : input->head_len;
+        memcpy(buf, input->head, take);
+        memmove(input->head, input->head + take, input->head_len - take);
+        input->head_len -= take;
+        return take;
+    }
+    if (input->decoder) {
+        return decoder_read(input->decoder, buf, n);
+    }
+    while (1) {
+        ssize_t got = read(input->fd, buf, n);
+        if (got >= 0) {
+            return (size_t)got;
+        }
+        if (errno != EINTR) {
+            return 0;
+        }
+        poll_snapshot();
+    }
+}
+
+// Read large blocks and hand every run of complete tokens (complete lines
+// when by_line is set) to parse() until it returns something but PARSE_END.
+// Uses read(2), so whatever a pipe has delivered is parsed right away
+// instead of waiting for a full block.
+ParseStatus read_blocks(Input *input, int by_line, BlockParser parse, void *ctx) {
+    size_t buf_size = READ_CHUNK_SIZE;
+    char *buf = malloc(buf_size);
+    if (!buf) {
+        return PARSE_NOMEM;
+    }
+
+    size_t filled = 0;
+    int eof = 0;
+    ParseStatus status = PARSE_END;
+
+    while (!eof && status == PARSE_END) {
+        size_t got = read_available(input, buf + filled, buf_size - filled);
+        filled += got;
+        if (got == 0) {
+            eof = 1;
+        }
+
+        // Only parse up to the last whitespace so no token is split
+        size_t limit = filled;
+        if (!eof) {
+            while (limit > 0 && !(by_line ? buf[limit - 1] == '\n' : is_space_char(buf[limit - 1]))) {
+                limit--;
+            }
+            if (limit == 0 && filled < buf_size) {
+                continue;   // Wait for the rest of the token
+            }
+            if (limit == 0) {
+                // A single token fills the whole buffer: make room for more
+                char *new_buf = realloc(buf, buf_size * 2);
+                if (!new_buf) {
+                    status = PARSE_NOMEM;
+                    break;
+                }
+                buf = new_buf;
+                buf_size *= 2;
+                continue;
+            }
+        }
+
+        status = parse(buf, buf + limit, ctx);
+
+        memmove(buf, buf + limit, filled - limit);
+        filled -= limit;
+    }
+
+    free(buf);
+    return status;
+}
+
+typedef struct {
+    const Columns *columns;
+    ValueSink *sink;
+} LinesContext;
+
+static ParseStatus parse_lines_block(const char *p, const char *end, void *ctx) {
+    LinesContext *lines = ctx;
+    return parse_lines(p, end, lines->columns, lines->sink);
+}
+
+// Parse a streamed text input block by block. Like the fscanf() loop this
+// replaces, reading stops at the first non-number.
+ParseStatus parse_stream(Input *input, ValueSink *sink) {
+    LinesContext lines = {&input->columns, sink};
+    return read_blocks(input, input->columns.column != 0, parse_lines_block, &lines);
+}
+
+// Parse a streamed text input into a new value store (see store_create()),
+// pre-sized from the file size when the stream is a regular file
+double* read_numbers(Input *input, size_t *count) {
+    ValueBuffer values;
+    if (value_buffer_init(&values, value_bound(input)) != 0) {
+        return NULL;
+    }
+
+    ValueSink sink = {value_buffer_consume, &values};
+    if (parse_stream(input, &sink) == PARSE_NOMEM) {
+        store_free(values.data);
+        return NULL;
+    }
+    *count = values.count;
+    return values.data;
+}
+
+// Map a regular file read-only with sequential read-ahead hints
+char* map_input(int fd, size_t size) {
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+    posix_madvise(data, size, POSIX_MADV_WILLNEED);
+    return data;
+}
+
+// Magic numbers of the compressed formats open_input() recognises, with
+// the library each one needs
+static const struct {
+    Compression kind;
+    const char *name;
+    const char *library;
+    size_t len;
+    unsigned char bytes[MAGIC_MAX];
+} magic_numbers[] = {
+    {COMPRESS_GZIP, "gzip", "zlib", 2, {0x1f, 0x8b}},
+    {COMPRESS_XZ, "xz", "liblzma", 6, {0xfd, '7', 'z', 'X', 'Z', 0x00}},
+    {COMPRESS_ZSTD, "zstd", "libzstd", 4, {0x28, 0xb5, 0x2f, 0xfd}},
+};
+
+#define N_MAGIC_NUMBERS (sizeof(magic_numbers) / sizeof(magic_numbers[0]))
+
+// Compression of an input starting with the n bytes at head
+Compression detect_compression(const unsigned char *head, size_t n) {
+    for (size_t i = 0; i < N_MAGIC_NUMBERS; i++) {
+        if (n >= magic_numbers[i].len && memcmp(head, magic_numbers[i].bytes, magic_numbers[i].len) == 0) {
+            return magic_numbers[i].kind;
+        }
+    }
+    return COMPRESS_NONE;
+}
+
+// Whether the n bytes at head could still grow into a magic number
+static int magic_prefix(const unsigned char *head, size_t n) {
+    for (size_t i = 0; i < N_MAGIC_NUMBERS; i++) {
+        if (n < magic_numbers[i].len && memcmp(head, magic_numbers[i].bytes, n) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether numstat was built with the library for a compressed format
+static int compression_built(Compression kind) {
+    switch (kind) {
+#ifdef HAVE_ZLIB
+    case COMPRESS_GZIP:
+#endif
+#ifdef HAVE_LZMA
+    case COMPRESS_XZ:
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+#endif
+    case COMPRESS_NONE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Read the start of a pipe into head, stopping as soon as the bytes can no
+// longer begin a magic number, so plain text on a terminal is not held up.
+// Returns how many bytes were read.
+static size_t read_magic(int fd, unsigned char *head) {
+    size_t n = 0;
+    do {
+        ssize_t got = read(fd, head + n, MAGIC_MAX - n);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        n += (size_t)got;
+    } while (n < MAGIC_MAX && magic_prefix(head, n));
+    return n;
+}
+
+// Set up the library's decoder. Returns -1 if it cannot be allocated.
+static int codec_init(Decoder *d) {
+    switch (d->kind) {
+#ifdef HAVE_ZLIB
+    case COMPRESS_GZIP:
+        memset(&d->gzip, 0, sizeof(d->gzip));
+        return inflateInit2(&d->gzip, 15 + 16) == Z_OK ? 0 : -1;   // gzip wrapper only
+#endif
+#ifdef HAVE_LZMA
+    case COMPRESS_XZ: {
+        lzma_stream init = LZMA_STREAM_INIT;
+        d->xz = init;
+        return lzma_stream_decoder(&d->xz, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK ? 0 : -1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+        d->zstd = ZSTD_createDStream();
+        return d->zstd && !ZSTD_isError(ZSTD_initDStream(d->zstd)) ? 0 : -1;
+#endif
+    default:
+        return -1;
+    }
+}
+
+static void codec_end(Decoder *d) {
+    switch (d->kind) {
+#ifdef HAVE_ZLIB
+    case COMPRESS_GZIP:
+        inflateEnd(&d->gzip);
+        break;
+#endif
+#ifdef HAVE_LZMA
+    case COMPRESS_XZ:
+        lzma_end(&d->xz);
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+        ZSTD_freeDStream(d->zstd);
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+// Decode buffered compressed input into out (size bytes), setting *written.
+// Returns 1 at the end of the data, -1 on corrupt data, 0 to go on.
+// Concatenated gzip members, xz streams and zstd frames are all decoded,
+// as zcat, xzcat and zstdcat do.
+static int codec_step(Decoder *d, char *out, size_t size, size_t *written) {
+    size_t avail = d->in_len - d->in_pos;
+    *written = 0;
+    switch (d->kind) {
+#ifdef HAVE_ZLIB
+    case COMPRESS_GZIP: {
+        d->gzip.next_in = d->in + d->in_pos;
+        d->gzip.avail_in = (uInt)avail;
+        d->gzip.next_out = (Bytef *)out;
+        d->gzip.avail_out = (uInt)size;
+        int rc = inflate(&d->gzip, Z_NO_FLUSH);
+        d->in_pos += avail - d->gzip.avail_in;
+        *written = size - d->gzip.avail_out;
+        if (rc == Z_STREAM_END) {
+            // Another member may follow
+            d->boundary = 1;
+            return inflateReset(&d->gzip) == Z_OK ? 0 : -1;
+        }
+        if (rc == Z_OK || rc == Z_BUF_ERROR) {
+            if (d->gzip.avail_in < avail || *written > 0) {
+                d->boundary = 0;    // Into the next member
+            }
+            return 0;
+        }
+        // Trailing garbage after a complete member ends the data, as with
+        // gzip -d
+        return d->boundary ? 1 : -1;
+    }
+#endif
+#ifdef HAVE_LZMA
+    case COMPRESS_XZ: {
+        d->xz.next_in = d->in + d->in_pos;
+        d->xz.avail_in = avail;
+        d->xz.next_out = (uint8_t *)out;
+        d->xz.avail_out = size;
+        lzma_ret rc = lzma_code(&d->xz, d->in_eof ? LZMA_FINISH : LZMA_RUN);
+        d->in_pos += avail - d->xz.avail_in;
+        *written = size - d->xz.avail_out;
+        d->boundary = rc == LZMA_STREAM_END;
+        return rc == LZMA_OK ? 0 : rc == LZMA_STREAM_END ? 1 : -1;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        ZSTD_inBuffer input = {d->in + d->in_pos, avail, 0};
+        ZSTD_outBuffer output = {out, size, 0};
+        size_t rc = ZSTD_decompressStream(d->zstd, &output, &input);
+        d->in_pos += input.pos;
+        *written = output.pos;
+        if (ZSTD_isError(rc)) {
+            return -1;
+        }
+        if (input.pos > 0 || output.pos > 0) {
+            d->boundary = rc == 0;  // A frame was completely decoded and flushed
+        }
+        return 0;
+    }
+#endif
+    default:
+        (void)avail;
+        (void)out;
+        (void)size;
+        return -1;
+    }
+}
+
+// Read more compressed input once the buffered input is used up. A pipe
+// may never deliver more when parsing ended early, so the wait also ends
+// when decoder_free() writes to the wake pipe.
+static void decoder_refill(Decoder *d) {
+    d->in_pos = 0;
+    d->in_len = 0;
+    while (1) {
+        struct pollfd fds[2] = {{d->fd, POLLIN, 0}, {d->wake[0], POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (fds[1].revents) {
+            d->in_eof = 1;
+            return;
+        }
+        ssize_t got = read(d->fd, d->in, DECODE_INPUT);
+        if (got > 0) {
+            d->in_len = (size_t)got;
+            return;
+        }
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        d->in_eof = 1;      // End of input, or a read error ends it
+        return;
+    }
+}
+
+// Decoder thread: fill the ring one slot at a time, waiting whenever all
+// DECODE_SLOTS hold data the parser has not taken yet
+static void* decoder_main(void *arg) {
+    Decoder *d = arg;
+    int status = 0;
+    while (status == 0) {
+        pthread_mutex_lock(&d->lock);
+        while (d->produced - d->consumed == DECODE_SLOTS && !d->stop) {
+            pthread_cond_wait(&d->room, &d->lock);
+        }
+        int stop = d->stop;
+        pthread_mutex_unlock(&d->lock);
+        if (stop) {
+            break;
+        }
+
+        char *slot = d->ring + (d->produced % DECODE_SLOTS) * DECODE_SLOT_SIZE;
+        size_t filled = 0;
+        while (status == 0 && filled < DECODE_SLOT_SIZE) {
+            if (d->in_pos == d->in_len && !d->in_eof) {
+                if (filled > 0) {
+                    break;  // Hand over what there is before read() may block
+                }
+                decoder_refill(d);
+            }
+            size_t written;
+            status = codec_step(d, slot + filled, DECODE_SLOT_SIZE - filled, &written);
+            filled += written;
+            if (status == 0 && written == 0 && d->in_pos == d->in_len && d->in_eof) {
+                // Out of input: fine between members or frames, else truncated
+                status = d->boundary ? 1 : -1;
+            }
+        }
+
+        pthread_mutex_lock(&d->lock);
+        if (filled > 0) {
+            d->lengths[d->produced % DECODE_SLOTS] = filled;
+            d->produced++;
+        }
+        d->failed = status < 0;
+        d->done = status != 0;
+        pthread_cond_signal(&d->ready);
+        pthread_mutex_unlock(&d->lock);
+    }
+    return NULL;
+}
+
+// Start decompressing fd (of the given kind) on a new thread. head holds
+// bytes already read from fd, to be decoded first. Returns NULL if memory
+// or the thread cannot be had.
+Decoder* decoder_start(int fd, Compression kind, const unsigned char *head, size_t head_len) {
+    Decoder *d = calloc(1, sizeof(Decoder));
+    if (!d) {
+        return NULL;
+    }
+    d->fd = fd;
+    d->kind = kind;
+    d->in = malloc(DECODE_INPUT);
+    d->ring = malloc((size_t)DECODE_SLOTS * DECODE_SLOT_SIZE);
+    if (!d->in || !d->ring || pipe(d->wake) != 0) {
+        free(d->in);
+        free(d->ring);
+        free(d);
+        return NULL;
+    }
+    if (codec_init(d) != 0) {
+        codec_end(d);
+        close(d->wake[0]);
+        close(d->wake[1]);
+        free(d->in);
+        free(d->ring);
+        free(d);
+        return NULL;
+    }
+    memcpy(d->in, head, head_len);
+    d->in_len = head_len;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->ready, NULL);
+    pthread_cond_init(&d->room, NULL);
+
+    // Signals (snapshot requests) must reach the parsing thread, so the
+    // decoder thread starts with them all blocked
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int failed = pthread_create(&d->thread, NULL, decoder_main, d) != 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (failed) {
+        codec_end(d);
+        close(d->wake[0]);
+        close(d->wake[1]);
+        pthread_mutex_destroy(&d->lock);
+        pthread_cond_destroy(&d->ready);
+        pthread_cond_destroy(&d->room);
+        free(d->in);
+        free(d->ring);
+        free(d);
+        return NULL;
+    }
+    return d;
+}
+
+// read_available() for compressed input: copy up to n bytes out of the
+// oldest filled slot, waiting for the decoder thread if none is ready.
+// Returns 0 at the end of the data.
+static size_t decoder_read(Decoder *d, char *buf, size_t n) {
+    pthread_mutex_lock(&d->lock);
+    while (d->consumed == d->produced && !d->done) {
+        // Wake up every 100 ms so a snapshot request is not held up by a
+        // slow pipe
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&d->ready, &d->lock, &deadline);
+        pthread_mutex_unlock(&d->lock);
+        poll_snapshot();
+        pthread_mutex_lock(&d->lock);
+    }
+    if (d->consumed == d->produced) {
+        if (d->failed) {
+            fprintf(stderr, "Warning: Compressed input is corrupt or truncated; "
+                            "using the data before the damage\n");
+            d->failed = 0;
+        }
+        pthread_mutex_unlock(&d->lock);
+        return 0;
+    }
+    size_t slot = d->consumed % DECODE_SLOTS;
+    size_t left = d->lengths[slot] - d->offset;
+    const char *src = d->ring + slot * DECODE_SLOT_SIZE + d->offset;
+    pthread_mutex_unlock(&d->lock);
+
+    // The decoder does not touch a filled slot until it is drained, so
+    // the copy needs no lock
+    size_t take = n < left ? n : left;
+    memcpy(buf, src, take);
+
+    pthread_mutex_lock(&d->lock);
+    d->offset += take;
+    if (d->offset == d->lengths[slot]) {
+        d->offset = 0;
+        d->consumed++;
+        pthread_cond_signal(&d->room);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return take;
+}
+
+// Stop the decoder thread (even if it is waiting for input that may never
+// come, when parsing ended early) and release everything
+void decoder_free(Decoder *d) {
+    if (!d) {
+        return;
+    }
+    pthread_mutex_lock(&d->lock);
+    d->stop = 1;
+    pthread_cond_signal(&d->room);
+    pthread_mutex_unlock(&d->lock);
+    char wake = 0;
+    ssize_t woken = write(d->wake[1], &wake, 1);
+    (void)woken;    // The pipe is empty: the byte always fits
+    pthread_join(d->thread, NULL);
+
+    codec_end(d);
+    close(d->wake[0]);
+    close(d->wake[1]);
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->ready);
+    pthread_cond_destroy(&d->room);
+    free(d->in);
+    free(d->ring);
+    free(d);
+}
+
+static void request_snapshot(int sig);
+
+// Open FILE (or take stdin) and pick how it will be read. Regular files
+// are mapped unless --no-mmap is given; --mmap rejects anything else.
+int open_input(const Config *config, Input *input) {
+    input->fd = STDIN_FILENO;
+    input->file = NULL;
+    input->size = 0;
+    input->owned = config->input_file != NULL;
+    input->format = config->format;
+    input->columns = config->columns;
+    input->decoder = NULL;
+    input->head_len = 0;
+
+    if (config->input_file) {
+        input->fd = open(config->input_file, O_RDONLY);
+        if (input->fd < 0) {
+            fprintf(stderr, "Error: Cannot open file '%s'\n", config->input_file);
+            return -1;
+        }
+    }
+
+    struct stat st;
+    int mappable = fstat(input->fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (config->io_mode == IO_MMAP && !mappable) {
+        fprintf(stderr, "Error: --mmap needs a regular file as input\n");
+        close_input(input);
+        return -1;
+    }
+
+    // Look for a compressed format's magic number: a regular file is
+    // peeked at, from a pipe the bytes have to be read (and kept)
+    unsigned char peek[MAGIC_MAX];
+    size_t peeked = 0;
+    if (mappable) {
+        ssize_t got = pread(input->fd, peek, MAGIC_MAX, 0);
+        peeked = got > 0 ? (size_t)got : 0;
+    } else {
+        // The first bytes may be slow to come: meanwhile SIGUSR1 is taken as
+        // a snapshot request, as it is once parsing starts, not fatal
+        struct sigaction hold, saved;
+        memset(&hold, 0, sizeof(hold));
+        hold.sa_handler = request_snapshot;
+        sigemptyset(&hold.sa_mask);
+        sigaction(SIGUSR1, &hold, &saved);
+        input->head_len = read_magic(input->fd, input->head);
+        sigaction(SIGUSR1, &saved, NULL);
+    }
+    Compression kind = mappable ? detect_compression(peek, peeked)
+                                : detect_compression(input->head, input->head_len);
+
+    if (kind != COMPRESS_NONE) {
+        const char *name = "";
+        const char *library = "";
+        for (size_t i = 0; i < N_MAGIC_NUMBERS; i++) {
+            if (magic_numbers[i].kind == kind) {
+                name = magic_numbers[i].name;
+                library = magic_numbers[i].library;
+            }
+        }
+        if (!compression_built(kind)) {
+            fprintf(stderr, "Error: Input is %s-compressed, but numstat was built without %s\n",
+                    name, library);
+            close_input(input);
+            return -1;
+        }
+        if (config->io_mode == IO_MMAP) {
+            fprintf(stderr, "Error: --mmap cannot read %s-compressed input\n", name);
+            close_input(input);
+            return -1;
+        }
+        // Decompressed data can only be streamed
+        mappable = 0;
+        input->decoder = decoder_start(input->fd, kind, input->head, input->head_len);
+        input->head_len = 0;
+        if (!input->decoder) {
+            fprintf(stderr, "Error: Cannot start decompressing the input\n");
+            close_input(input);
+            return -1;
+        }
+    }
+
+    if (mappable && config->io_mode != IO_STREAM) {
+        input->size = (size_t)st.st_size;
+        return 0;
+    }
+
+    input->file = input->owned ? fdopen(input->fd, "r") : stdin;
+    if (!input->file) {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", config->input_file);
+        close_input(input);
+        return -1;
+    }
+    return 0;
+}
+
+void close_input(Input *input) {
+    decoder_free(input->decoder);
+    input->decoder = NULL;
+    if (!input->owned) {
+        return;
+    }
+    if (input->file) {
+        fclose(input->file);
+    } else if (input->fd >= 0) {
+        close(input->fd);
+    }
+    input->file = NULL;
+    input->fd = -1;
+}
+
+// Single-threaded parse of a whole input, mapped or streamed
+ParseStatus parse_input(Input *input, ValueSink *sink) {
+    if (input->file) {
+        return input->format == FORMAT_TEXT ? parse_stream(input, sink)
+                                            : parse_binary_stream(input, sink);
+    }
+    if (input->size == 0) {
+        return PARSE_END;
+    }
+
+    char *data = map_input(input->fd, input->size);
+    if (!data) {
+        return PARSE_NOMEM;
+    }
+    ParseStatus status = input->format == FORMAT_TEXT
+                             ? parse_lines(data, data + input->size, &input->columns, sink)
+                             : parse_binary(data, input->size, input->format, sink);
+    munmap(data, input->size);
+    return status;
+}
+
+size_t format_record_size(InputFormat format) {
+    switch (format) {
+    case FORMAT_F64LE:
+    case FORMAT_I64LE:
+        return 8;
+    case FORMAT_F32LE:
+    case FORMAT_I32LE:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+static inline uint64_t load_le64(const unsigned char *p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+           (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+           (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t load_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Convert n packed records to doubles. The byte loads compile to plain
+// (or byte-swapped) word loads; 64-bit integers beyond 2^53 are rounded.
+static void decode_records(const unsigned char *p, size_t n, InputFormat format, double *out) {
+    for (size_t i = 0; i < n; i++) {
+        switch (format) {
+        case FORMAT_F64LE: {
+            uint64_t bits = load_le64(p + i * 8);
+            memcpy(&out[i], &bits, sizeof(double));
+            break;
+        }
+        case FORMAT_F32LE: {
+            uint32_t bits = load_le32(p + i * 4);
+            float f;
+            memcpy(&f, &bits, sizeof(float));
+            out[i] = f;
+            break;
+        }
+        case FORMAT_I64LE:
+            out[i] = (double)(int64_t)load_le64(p + i * 8);
+            break;
+        case FORMAT_I32LE:
+            out[i] = (double)(int32_t)load_le32(p + i * 4);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void warn_partial_record(size_t bytes) {
+    fprintf(stderr, "Warning: Ignoring %zu trailing byte%s (incomplete record)\n",
+            bytes, bytes == 1 ? "" : "s");
+}
+
+// Decode every complete record in [data, data + size) and hand the values
+// to the sink in batches of PARSE_BATCH
+ParseStatus parse_binary(const char *data, size_t size, InputFormat format, ValueSink *sink) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t record = format_record_size(format);
+    size_t n = size / record;
+    double batch[PARSE_BATCH];
+
+    for (size_t i = 0; i < n; i += PARSE_BATCH) {
+        size_t len = n - i < PARSE_BATCH ? n - i : PARSE_BATCH;
+        decode_records(p + i * record, len, format, batch);
+        if (sink->consume(sink->ctx, batch, len) != 0) {
+            return PARSE_NOMEM;
+        }
+    }
+    if (size % record != 0) {
+        warn_partial_record(size % record);
+    }
+    return PARSE_END;
+}
+
+// Read binary records from a pipe or terminal in blocks of up to
+// READ_CHUNK_SIZE.
+// A record split across two reads is carried over to the next block.
+ParseStatus parse_binary_stream(Input *input, ValueSink *sink) {
+    char *buf = malloc(READ_CHUNK_SIZE);
+    if (!buf) {
+        return PARSE_NOMEM;
+    }
+
+    InputFormat format = input->format;
+    size_t record = format_record_size(format);
+    size_t filled = 0;
+    ParseStatus status = PARSE_END;
+    while (status == PARSE_END) {
+        size_t got = read_available(input, buf + filled, READ_CHUNK_SIZE - filled);
+        filled += got;
+        if (got == 0) {
+            // End of input: whatever is left is an incomplete record
+            status = parse_binary(buf, filled, format, sink);
+            break;
+        }
+
+        size_t whole = filled - filled % record;
+        status = parse_binary(buf, whole, format, sink);
+        memmove(buf, buf + whole, filled - whole);
+        filled -= whole;
+    }
+
+    free(buf);
+    return status;
+}
+
+// Read a whole binary input into a new array of doubles
+double* read_binary(Input *input, size_t *count) {
+    ValueBuffer values;
+    if (value_buffer_init(&values, value_bound(input)) != 0) {
+        return NULL;
+    }
+
+    ValueSink sink = {value_buffer_consume, &values};
+    if (parse_input(input, &sink) == PARSE_NOMEM) {
+        store_free(values.data);
+        return NULL;
+    }
+    *count = values.count;
+    return values.data;
+}
+
+// Read the whole input, text or binary, into a new array of floats for
+// --float32, printing snapshots along the way if asked to
+float* read_floats(Input *input, const Config *config, size_t *count) {
+    FloatBuffer values;
+    if (float_buffer_init(&values, value_bound(input)) != 0) {
+        return NULL;
+    }
+
+    ValueSink sink = {float_buffer_consume, &values};
+    ParseStatus status;
+    if (snapshots_wanted(config, input)) {
+        StreamState state;
+        state.digest = NULL;
+        state.hdr = NULL;
+        status = parse_with_snapshots(input, config, &sink, &state);
+    } else {
+        status = parse_input(input, &sink);
+    }
+    if (status == PARSE_NOMEM) {
+        store_free(values.data);
+        return NULL;
+    }
+    *count = values.count;
+    return values.data;
+}
+
+// Map an f64le file and return the records themselves, without parsing or
+// copying. The mapping is read-only; the caller unmaps input->size bytes.
+const double* map_f64le(Input *input, size_t *count) {
+    char *data = map_input(input->fd, input->size);
+    if (!data) {
+        return NULL;
+    }
+    if (input->size % sizeof(double) != 0) {
+        warn_partial_record(input->size % sizeof(double));
+    }
+    *count = input->size / sizeof(double);
+    return (const double *)data;
+}
+
+// Run worker(&jobs[i]) for n jobs, one thread each. Job 0 runs on the
+// calling thread; a job whose thread cannot be created runs inline too.
+void run_workers(void *(*worker)(void *), void *jobs, size_t job_size, int n) {
+    char *job = jobs;
+    if (n <= 1) {
+        worker(job);
+        return;
+    }
+
+    pthread_t *tids = malloc((size_t)n * sizeof(pthread_t));
+    int *started = calloc((size_t)n, sizeof(int));
+    for (int i = 1; i < n; i++) {
+        if (tids && started &&
+            pthread_create(&tids[i], NULL, worker, job + (size_t)i * job_size) == 0) {
+            started[i] = 1;
+        } else {
+            worker(job + (size_t)i * job_size);
+        }
+    }
+    worker(job);
+    for (int i = 1; i < n; i++) {
+        if (started && started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+    free(tids);
+    free(started);
+}
+
+static void* parse_chunk_worker(void *arg) {
+    ParseChunk *chunk = arg;
+    if (value_buffer_init(&chunk->values, chunk->expected) != 0) {
+        chunk->status = PARSE_NOMEM;
+        return NULL;
+    }
+    ValueSink sink = {value_buffer_consume, &chunk->values};
+    chunk->status = parse_lines(chunk->begin, chunk->end, chunk->columns, &sink);
+    return NULL;
+}
+
+static void* stitch_chunk_worker(void *arg) {
+    ParseChunk *chunk = arg;
+    if (chunk->dest) {
+        memcpy(chunk->dest, chunk->values.data, chunk->values.count * sizeof(double));
+    }
+    store_free(chunk->values.data);
+    chunk->values.data = NULL;
+    return NULL;
+}
+
+// Parse a regular file straight out of a read-only mapping. This skips the
+// copy into the stdio buffer and its per-call locking. With several threads
+// the mapping is cut at whitespace (line ends when a column is selected) near
+// equal offsets, each thread parses its slice into its own buffer, and the
+// other buffers are appended to the first in input order. The first buffer
+// is reserved for the whole file, so it never moves.
+double* read_numbers_mmap(int fd, size_t size, const Columns *columns, size_t *count,
+                          int threads) {
+    *count = 0;
+    if (size == 0) {
+        return store_alloc(sizeof(double));  // mmap() rejects empty mappings
+    }
+
+    char *data = map_input(fd, size);
+    if (!data) {
+        return NULL;
+    }
+
+    if ((size_t)threads > size / MIN_PARSE_CHUNK) {
+        threads = (int)(size / MIN_PARSE_CHUNK);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    ParseChunk *chunks = calloc((size_t)threads, sizeof(ParseChunk));
+    if (!chunks) {
+        munmap(data, size);
+        return NULL;
+    }
+
+    const char *end = data + size;
+    const char *begin = data;
+    for (int i = 0; i < threads; i++) {
+        const char *cut = i == threads - 1 ? end : data + size / (size_t)threads * (size_t)(i + 1);
+        if (cut < begin) {
+            cut = begin;
+        }
+        while (cut < end && !is_cut_char(*cut, columns)) {
+            cut++;
+        }
+        chunks[i].begin = begin;
+        chunks[i].end = cut;
+        chunks[i].columns = columns;
+        chunks[i].expected = (size_t)((i == 0 ? end : cut) - begin) / 2 + 1;
+        begin = cut;
+    }
+
+    run_workers(parse_chunk_worker, chunks, sizeof(ParseChunk), threads);
+    munmap(data, size);
+
+    // Input ends at the first chunk that stopped on a non-number
+    int used = threads;
+    int failed = 0;
+    size_t total = 0;
+    for (int i = 0; i < threads; i++) {
+        if (chunks[i].status == PARSE_NOMEM) {
+            failed = 1;
+        }
+        if (i < used) {
+            total += chunks[i].values.count;
+            if (chunks[i].status == PARSE_STOP) {
+                used = i + 1;
+            }
+        }
+    }
+
+    double *values = NULL;
+    if (!failed) {
+        void *data = chunks[0].values.data;
+        if (store_grow(&data, total * sizeof(double)) == 0) {
+            values = data;
+            chunks[0].values.data = NULL;
+        }
+    }
+
+    size_t offset = 0;
+    for (int i = 0; i < threads; i++) {
+        chunks[i].dest = (values && i > 0 && i < used) ? values + offset : NULL;
+        offset += chunks[i].values.count;
+    }
+    run_workers(stitch_chunk_worker, chunks, sizeof(ParseChunk), threads);
+    free(chunks);
+
+    if (values) {
+        *count = total;
+    }
+    return values;
+}
+
+// Reference reader used by --bench-parse: the original fscanf() loop
+double* read_numbers_scanf(FILE *file, size_t *count) {
+    double *values = NULL;
+    size_t capacity = 16;
+    *count = 0;
+    double num;
+
+    values = malloc(capacity * sizeof(double));
+    if (!values) {
+        return NULL;
+    }
+
+    while (fscanf(file, "%lf", &num) == 1) {
+        if (*count >= capacity) {
+            capacity *= 2;
+            double *new_values = realloc(values, capacity * sizeof(double));
+            if (!new_values) {
+                free(values);
+                return NULL;
+            }
+            values = new_values;
+        }
+        values[(*count)++] = num;
+    }
+
+    return values;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void print_bench_line(const char *name, double seconds, size_t tokens, long bytes) {
+    printf("  %-8s %9.4f s  %10.2f Mtok/s  %9.2f MB/s\n", name, seconds,
+           (double)tokens / seconds / 1e6, (double)bytes / seconds / 1e6);
+}
+
+static void free_bench_result(int which, double *values) {
+    if (which == 0) {
+        free(values);   // read_numbers_scanf() uses malloc()
+    } else {
+        store_free(values);
+    }
+}
+
+// Time the fscanf() reader against the stdio and mmap readers on the same
+// file (best of BENCH_RUNS) and check that all produce bit-identical values.
+// The mmap reader uses the requested number of parsing threads.
+int run_parse_benchmark(const char *path, int threads) {
+    static const char *names[BENCH_READERS] = {"fscanf", "stream", "mmap"};
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", path);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long bytes = ftell(file);
+
+    double best[BENCH_READERS];
+    double *results[BENCH_READERS] = {NULL};
+    size_t counts[BENCH_READERS] = {0};
+    for (int which = 0; which < BENCH_READERS; which++) {
+        best[which] = INFINITY;
+    }
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        for (int which = 0; which < BENCH_READERS; which++) {
+            rewind(file);
+            double start = now_seconds();
+            double *values;
+            Columns tokens = {0, 0, 0, 0, 0};
+            if (which == 0) {
+                values = read_numbers_scanf(file, &counts[which]);
+            } else if (which == 1) {
+                Input stream = {.fd = fileno(file), .file = file, .format = FORMAT_TEXT,
+                                .columns = tokens};
+                values = read_numbers(&stream, &counts[which]);
+            } else {
+                values = read_numbers_mmap(fileno(file), (size_t)bytes, &tokens, &counts[which],
+                                           threads);
+            }
+            double elapsed = now_seconds() - start;
+            if (!values) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                fclose(file);
+                for (int i = 0; i < BENCH_READERS; i++) {
+                    free_bench_result(i, results[i]);
+                }
+                return 1;
+            }
+            if (elapsed < best[which]) {
+                best[which] = elapsed;
+            }
+            free_bench_result(which, results[which]);
+            results[which] = values;
+        }
+    }
+    fclose(file);
+
+    int identical = 1;
+    for (int which = 1; which < BENCH_READERS; which++) {
+        identical = identical && counts[which] == counts[0] &&
+                    memcmp(results[which], results[0], counts[0] * sizeof(double)) == 0;
+    }
+
+    printf("Parser benchmark for '%s' (%ld bytes, %zu tokens, best of %d):\n",
+           path, bytes, counts[0], BENCH_RUNS);
+    for (int which = 0; which < BENCH_READERS; which++) {
+        print_bench_line(names[which], best[which], counts[which], bytes);
+    }
+    printf("  Speedup: %.2fx (stream), %.2fx (mmap)\n", best[0] / best[1], best[0] / best[2]);
+    printf("  Results: %s\n", identical ? "bit-identical" : "MISMATCH");
+
+    for (int which = 0; which < BENCH_READERS; which++) {
+        free_bench_result(which, results[which]);
+    }
+    return identical ? 0 : 1;
+}
+
+void moments_init(Moments *m) {
+    m->count = 0;
+    m->sum = 0.0;
+    m->mean = 0.0;
+    m->m2 = 0.0;
+    m->min = INFINITY;
+    m->max = -INFINITY;
+}
+
+// Combine two sets of moments (Chan et al. pairwise update). Works for any
+// two disjoint sets of values, e.g. thread partials or separate files/runs.
+void moments_merge(Moments *into, const Moments *other) {
+    if (other->count == 0) {
+        return;
+    }
+    if (into->count == 0) {
+        *into = *other;
+        return;
+    }
+
+    double n_a = (double)into->count;
+    double n_b = (double)other->count;
+    double n = n_a + n_b;
+    double delta = other->mean - into->mean;
+
+    into->mean += delta * n_b / n;
+    into->m2 += other->m2 + delta * delta * n_a * n_b / n;
+    into->sum += other->sum;
+    into->count += other->count;
+    if (other->min < into->min) into->min = other->min;
+    if (other->max > into->max) into->max = other->max;
+}
+
+// Sum of squared deviations, corrected for rounding in the mean (the sum
+// of the plain deviations would be zero with exact arithmetic). Skipped if
+// the values are so large that the correction itself overflows.
+static inline double corrected_m2(double squares, double deviation, size_t n) {
+    double correction = deviation * deviation / (double)n;
+    return isfinite(correction) ? squares - correction : squares;
+}
+
+// Moments of one block with plain C. Also handles the tails the vector
+// kernels leave over. Two passes over a block that is still in cache: sum,
+// min and max first, then squared deviations from the block mean.
+static void moments_block_scalar(const double *values, size_t n, Moments *out) {
+    double sum = 0.0, min = INFINITY, max = -INFINITY;
+    for (size_t i = 0; i < n; i++) {
+        sum += values[i];
+        if (values[i] < min) min = values[i];
+        if (values[i] > max) max = values[i];
+    }
+
+    double mean = sum / (double)n;
+    double squares = 0.0, deviation = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double diff = values[i] - mean;
+        squares += diff * diff;
+        deviation += diff;
+    }
+
+    out->count = n;
+    out->sum = sum;
+    out->mean = mean;
+    out->m2 = corrected_m2(squares, deviation, n);
+    out->min = min;
+    out->max = max;
+}
+
+// Merge a vector kernel's result with the scalar moments of the leftover
+// values at the end of the block
+static void moments_block_finish(const double *values, size_t n, size_t done,
+                                 double sum, double min, double max, Moments *out) {
+    for (size_t i = done; i < n; i++) {
+        sum += values[i];
+        if (values[i] < min) min = values[i];
+        if (values[i] > max) max = values[i];
+    }
+    out->count = n;
+    out->sum = sum;
+    out->mean = sum / (double)n;
+    out->min = min;
+    out->max = max;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The vector kernels keep several independent accumulators so the adds are
+// not serialised on one register. min_pd(x, acc) returns acc when x is NaN,
+// which skips NaNs the same way the scalar comparisons do.
+
+static void moments_block_sse2(const double *values, size_t n, Moments *out) {
+    __m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd();
+    __m128d min0 = _mm_set1_pd(INFINITY), min1 = min0;
+    __m128d max0 = _mm_set1_pd(-INFINITY), max1 = max0;
+    size_t done = n & ~(size_t)3;
+    for (size_t i = 0; i < done; i += 4) {
+        __m128d a = _mm_loadu_pd(values + i);
+        __m128d b = _mm_loadu_pd(values + i + 2);
+        sum0 = _mm_add_pd(sum0, a);
+        sum1 = _mm_add_pd(sum1, b);
+        min0 = _mm_min_pd(a, min0);
+        min1 = _mm_min_pd(b, min1);
+        max0 = _mm_max_pd(a, max0);
+        max1 = _mm_max_pd(b, max1);
+    }
+    double s[2], lo[2], hi[2];
+    _mm_storeu_pd(s, _mm_add_pd(sum0, sum1));
+    _mm_storeu_pd(lo, _mm_min_pd(min0, min1));
+    _mm_storeu_pd(hi, _mm_max_pd(max0, max1));
+    moments_block_finish(values, n, done, s[0] + s[1], fmin(lo[0], lo[1]),
+                         fmax(hi[0], hi[1]), out);
+
+    __m128d mean = _mm_set1_pd(out->mean);
+    __m128d sq0 = _mm_setzero_pd(), sq1 = _mm_setzero_pd();
+    __m128d dev0 = _mm_setzero_pd(), dev1 = _mm_setzero_pd();
+    for (size_t i = 0; i < done; i += 4) {
+        __m128d a = _mm_sub_pd(_mm_loadu_pd(values + i), mean);
+        __m128d b = _mm_sub_pd(_mm_loadu_pd(values + i + 2), mean);
+        sq0 = _mm_add_pd(sq0, _mm_mul_pd(a, a));
+        sq1 = _mm_add_pd(sq1, _mm_mul_pd(b, b));
+        dev0 = _mm_add_pd(dev0, a);
+        dev1 = _mm_add_pd(dev1, b);
+    }
+    double q[2], d[2];
+    _mm_storeu_pd(q, _mm_add_pd(sq0, sq1));
+    _mm_storeu_pd(d, _mm_add_pd(dev0, dev1));
+    double squares = q[0] + q[1], deviation = d[0] + d[1];
+    for (size_t i = done; i < n; i++) {
+        double diff = values[i] - out->mean;
+        squares += diff * diff;
+        deviation += diff;
+    }
+    out->m2 = corrected_m2(squares, deviation, n);
+}
+
+__attribute__((target("avx2")))
+static void moments_block_avx2(const double *values, size_t n, Moments *out) {
+    __m256d sum[4], min[4], max[4];
+    for (int k = 0; k < 4; k++) {
+        sum[k] = _mm256_setzero_pd();
+        min[k] = _mm256_set1_pd(INFINITY);
+        max[k] = _mm256_set1_pd(-INFINITY);
+    }
+    size_t done = n & ~(size_t)15;
+    for (size_t i = 0; i < done; i += 16) {
+        for (int k = 0; k < 4; k++) {
+            __m256d x = _mm256_loadu_pd(values + i + 4 * k);
+            sum[k] = _mm256_add_pd(sum[k], x);
+            min[k] = _mm256_min_pd(x, min[k]);
+            max[k] = _mm256_max_pd(x, max[k]);
+        }
+    }
+    __m256d s = _mm256_add_pd(_mm256_add_pd(sum[0], sum[1]), _mm256_add_pd(sum[2], sum[3]));
+    __m256d lo = _mm256_min_pd(_mm256_min_pd(min[0], min[1]), _mm256_min_pd(min[2], min[3]));
+    __m256d hi = _mm256_max_pd(_mm256_max_pd(max[0], max[1]), _mm256_max_pd(max[2], max[3]));
+    double sv[4], lv[4], hv[4];
+    _mm256_storeu_pd(sv, s);
+    _mm256_storeu_pd(lv, lo);
+    _mm256_storeu_pd(hv, hi);
+    moments_block_finish(values, n, done, (sv[0] + sv[1]) + (sv[2] + sv[3]),
+                         fmin(fmin(lv[0], lv[1]), fmin(lv[2], lv[3])),
+                         fmax(fmax(hv[0], hv[1]), fmax(hv[2], hv[3])), out);
+
+    __m256d mean = _mm256_set1_pd(out->mean);
+    __m256d sq[4], dev[4];
+    for (int k = 0; k < 4; k++) {
+        sq[k] = _mm256_setzero_pd();
+        dev[k] = _mm256_setzero_pd();
+    }
+    for (size_t i = 0; i < done; i += 16) {
+        for (int k = 0; k < 4; k++) {
+            __m256d d = _mm256_sub_pd(_mm256_loadu_pd(values + i + 4 * k), mean);
+            sq[k] = _mm256_add_pd(sq[k], _mm256_mul_pd(d, d));
+            dev[k] = _mm256_add_pd(dev[k], d);
+        }
+    }
+    double qv[4], dv[4];
+    _mm256_storeu_pd(qv, _mm256_add_pd(_mm256_add_pd(sq[0], sq[1]), _mm256_add_pd(sq[2], sq[3])));
+    _mm256_storeu_pd(dv, _mm256_add_pd(_mm256_add_pd(dev[0], dev[1]), _mm256_add_pd(dev[2], dev[3])));
+    double squares = (qv[0] + qv[1]) + (qv[2] + qv[3]);
+    double deviation = (dv[0] + dv[1]) + (dv[2] + dv[3]);
+    for (size_t i = done; i < n; i++) {
+        double diff = values[i] - out->mean;
+        squares += diff * diff;
+        deviation += diff;
+    }
+    out->m2 = corrected_m2(squares, deviation, n);
+}
+
+__attribute__((target("avx512f")))
+static void moments_block_avx512(const double *values, size_t n, Moments *out) {
+    __m512d sum0 = _mm512_setzero_pd(), sum1 = _mm512_setzero_pd();
+    __m512d min0 = _mm512_set1_pd(INFINITY), min1 = min0;
+    __m512d max0 = _mm512_set1_pd(-INFINITY), max1 = max0;
+    size_t done = n & ~(size_t)15;
+    for (size_t i = 0; i < done; i += 16) {
+        __m512d a = _mm512_loadu_pd(values + i);
+        __m512d b = _mm512_loadu_pd(values + i + 8);
+        sum0 = _mm512_add_pd(sum0, a);
+        sum1 = _mm512_add_pd(sum1, b);
+        min0 = _mm512_min_pd(a, min0);
+        min1 = _mm512_min_pd(b, min1);
+        max0 = _mm512_max_pd(a, max0);
+        max1 = _mm512_max_pd(b, max1);
+    }
+    moments_block_finish(values, n, done,
+                         _mm512_reduce_add_pd(_mm512_add_pd(sum0, sum1)),
+                         _mm512_reduce_min_pd(_mm512_min_pd(min0, min1)),
+                         _mm512_reduce_max_pd(_mm512_max_pd(max0, max1)), out);
+
+    __m512d mean = _mm512_set1_pd(out->mean);
+    __m512d sq0 = _mm512_setzero_pd(), sq1 = _mm512_setzero_pd();
+    __m512d dev0 = _mm512_setzero_pd(), dev1 = _mm512_setzero_pd();
+    for (size_t i = 0; i < done; i += 16) {
+        __m512d a = _mm512_sub_pd(_mm512_loadu_pd(values + i), mean);
+        __m512d b = _mm512_sub_pd(_mm512_loadu_pd(values + i + 8), mean);
+        sq0 = _mm512_fmadd_pd(a, a, sq0);
+        sq1 = _mm512_fmadd_pd(b, b, sq1);
+        dev0 = _mm512_add_pd(dev0, a);
+        dev1 = _mm512_add_pd(dev1, b);
+    }
+    double squares = _mm512_reduce_add_pd(_mm512_add_pd(sq0, sq1));
+    double deviation = _mm512_reduce_add_pd(_mm512_add_pd(dev0, dev1));
+    for (size_t i = done; i < n; i++) {
+        double diff = values[i] - out->mean;
+        squares += diff * diff;
+        deviation += diff;
+    }
+    out->m2 = corrected_m2(squares, deviation, n);
+}
+
+#endif
+
+static MomentsKernel moments_kernel = moments_block_scalar;
+static pthread_once_t moments_kernel_once = PTHREAD_ONCE_INIT;
+
+// Pick the widest kernel the CPU supports (SSE2 is part of x86-64)
+static void select_moments_kernel(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        moments_kernel = moments_block_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        moments_kernel = moments_block_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        moments_kernel = moments_block_sse2;
+    }
+#endif
+}
+
+// Fold values into m one MOMENT_BLOCK at a time: each block is read from
+// memory once by the vector kernel (its second pass hits the cache), and
+// the block moments are merged with the Chan et al. update
+void moments_add(Moments *m, const double *values, size_t n) {
+    pthread_once(&moments_kernel_once, select_moments_kernel);
+    for (size_t i = 0; i < n; i += MOMENT_BLOCK) {
+        Moments block;
+        moments_kernel(values + i, n - i < MOMENT_BLOCK ? n - i : MOMENT_BLOCK, &block);
+        moments_merge(m, &block);
+    }
+}
+
+// A thread's share of moments_reduce(): whole chunks [first, last)
+typedef struct {
+    const double *values;
+    const float *floats;    // Used instead of values for --float32
+    size_t n;
+    size_t first;
+    size_t last;
+    Moments *partials;
+} ReduceJob;
+
+// Moments of 4-byte values, accumulated in double: each MOMENT_BLOCK is
+// widened into a stack buffer for the vector kernel
+void moments_add_float(Moments *m, const float *values, size_t n) {
+    double block[MOMENT_BLOCK];
+    for (size_t i = 0; i < n; i += MOMENT_BLOCK) {
+        size_t len = n - i < MOMENT_BLOCK ? n - i : MOMENT_BLOCK;
+        for (size_t j = 0; j < len; j++) {
+            block[j] = values[i + j];
+        }
+        moments_add(m, block, len);
+    }
+}
+
+static void chunk_moments(const double *values, const float *floats, size_t n, size_t chunk,
+                          Moments *m) {
+    size_t begin = chunk * REDUCE_CHUNK;
+    size_t len = n - begin < REDUCE_CHUNK ? n - begin : REDUCE_CHUNK;
+    moments_init(m);
+    if (floats) {
+        moments_add_float(m, floats + begin, len);
+    } else {
+        moments_add(m, values + begin, len);
+    }
+}
+
+static void* reduce_worker(void *arg) {
+    ReduceJob *job = arg;
+    for (size_t c = job->first; c < job->last; c++) {
+        chunk_moments(job->values, job->floats, job->n, c, &job->partials[c]);
+    }
+    return NULL;
+}
+
+static void reduce_chunks(const double *values, const float *floats, size_t n, int threads,
+                          Moments *out);
+
+// Moments of an in-memory array. Each REDUCE_CHUNK slice gets its own
+// partial, computed by the worker threads, and the partials are merged in
+// input order, so the result does not depend on the number of threads.
+void moments_reduce(const double *values, size_t n, int threads, Moments *out) {
+    reduce_chunks(values, NULL, n, threads, out);
+}
+
+// moments_reduce() of a --float32 array
+void moments_reduce_float(const float *values, size_t n, int threads, Moments *out) {
+    reduce_chunks(NULL, values, n, threads, out);
+}
+
+static void reduce_chunks(const double *values, const float *floats, size_t n, int threads,
+                          Moments *out) {
+    size_t n_chunks = (n + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+    if ((size_t)threads > n_chunks) {
+        threads = (int)n_chunks;
+    }
+
+    Moments *partials = NULL;
+    ReduceJob *jobs = NULL;
+    if (threads > 1) {
+        partials = malloc(n_chunks * sizeof(Moments));
+        jobs = malloc((size_t)threads * sizeof(ReduceJob));
+    }
+
+    moments_init(out);
+    if (!partials || !jobs) {
+        // Single thread (or no memory for partials): same chunks, same order
+        for (size_t c = 0; c < n_chunks; c++) {
+            Moments part;
+            chunk_moments(values, floats, n, c, &part);
+            moments_merge(out, &part);
+        }
+        free(partials);
+        free(jobs);
+        return;
+    }
+
+    for (int t = 0; t < threads; t++) {
+        jobs[t].values = values;
+        jobs[t].floats = floats;
+        jobs[t].n = n;
+        jobs[t].first = n_chunks * (size_t)t / (size_t)threads;
+        jobs[t].last = n_chunks * (size_t)(t + 1) / (size_t)threads;
+        jobs[t].partials = partials;
+    }
+    run_workers(reduce_worker, jobs, sizeof(ReduceJob), threads);
+
+    for (size_t c = 0; c < n_chunks; c++) {
+        moments_merge(out, &partials[c]);
+    }
+    free(partials);
+    free(jobs);
+}
+
+// Fold in a single value (Welford's update), for callers that see one
+// value at a time per accumulator
+void moments_push(Moments *m, double value) {
+    m->count++;
+    double delta = value - m->mean;
+    m->mean += delta / (double)m->count;
+    m->m2 += delta * (value - m->mean);
+    m->sum += value;
+    if (value < m->min) m->min = value;
+    if (value > m->max) m->max = value;
+}
+
+void stats_from_moments(const Moments *m, Stats *stats) {
+    stats->has_quantiles = 0;
+    stats->count = m->count;
+    stats->sum = m->sum;
+    stats->mean = m->mean;
+    stats->min = m->min;
+    stats->max = m->max;
+    stats->range = m->max - m->min;
+    stats->median = stats->q1 = stats->q3 = NAN;
+    stats->rank_error = NAN;
+    stats->value_error = NAN;
+    stats->n_percentiles = 0;
+    stats->variance = m->count ? m->m2 / (double)m->count : 0.0;
+    stats->stddev = sqrt(stats->variance);
+    stats->histogram = NULL;
+}
+
+// ValueSink callback for --stream and --tdigest
+int stream_consume(void *ctx, const double *values, size_t n) {
+    StreamState *state = ctx;
+    moments_add(&state->moments, values, n);
+    if (state->digest) {
+        tdigest_add(state->digest, values, n);
+    }
+    if (state->hdr) {
+        return hdr_add(state->hdr, values, n);
+    }
+    return 0;
+}
+
+// --stream/--tdigest: parse the input into running moments, plus a t-digest
+// for the quartiles when compression > 0. Memory use does not depend on the
+// input size.
+int stream_stats(Input *input, const Config *config, Stats *stats) {
+    StreamState state;
+    state.digest = NULL;
+    state.hdr = NULL;
+    if (config->tdigest > 0) {
+        state.digest = tdigest_create(config->tdigest);
+        if (!state.digest) {
+            return -1;
+        }
+    }
+    if (config->hdr) {
+        state.hdr = hdr_create(config->hdr);
+        if (!state.hdr) {
+            return -1;
+        }
+    }
+
+    if (parse_with_snapshots(input, config, NULL, &state) == PARSE_NOMEM) {
+        tdigest_free(state.digest);
+        hdr_free(state.hdr);
+        return -1;
+    }
+
+    stats_from_moments(&state.moments, stats);
+    if (state.digest && state.moments.count > 0) {
+        stats_from_tdigest(state.digest, config->percentiles, config->n_percentiles, stats);
+    }
+    if (state.hdr && state.moments.count > 0) {
+        stats_from_hdr(state.hdr, config->percentiles, config->n_percentiles, stats);
+    }
+    tdigest_free(state.digest);
+    hdr_free(state.hdr);
+    return 0;
+}
+
+// Set from signal handlers: a snapshot should be printed
+static volatile sig_atomic_t snapshot_pending;
+static Snapshots *active_snapshots;
+
+static void request_snapshot(int sig) {
+    (void)sig;
+    snapshot_pending = 1;
+}
+
+static void print_snapshot(Snapshots *snapshots) {
+    Stats stats;
+    stats_from_moments(&snapshots->state.moments, &stats);
+    if (snapshots->state.digest && snapshots->state.moments.count > 0) {
+        stats_from_tdigest(snapshots->state.digest, snapshots->percentiles,
+                           snapshots->n_percentiles, &stats);
+    }
+    if (snapshots->state.hdr && snapshots->state.moments.count > 0) {
+        stats_from_hdr(snapshots->state.hdr, snapshots->percentiles,
+                       snapshots->n_percentiles, &stats);
+    }
+    if (snapshots->json_output) {
+        print_stats_json(&stats, snapshots->precision);
+    } else {
+        print_stats_text(&stats, snapshots->precision);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+// Print a snapshot if SIGUSR1 or the --interval timer asked for one
+void poll_snapshot(void) {
+    if (snapshot_pending && active_snapshots) {
+        snapshot_pending = 0;
+        print_snapshot(active_snapshots);
+    }
+}
+
+// ValueSink callback: update the running state, pass the values on, and
+// report at every multiple of --every
+static int snapshot_consume(void *ctx, const double *values, size_t n) {
+    Snapshots *snapshots = ctx;
+    while (n > 0) {
+        size_t take = n;
+        if (snapshots->every) {
+            size_t left = snapshots->next_report - snapshots->state.moments.count;
+            take = n < left ? n : left;
+        }
+        if (snapshots->inner && snapshots->inner->consume(snapshots->inner->ctx, values, take) != 0) {
+            return -1;
+        }
+        if (stream_consume(&snapshots->state, values, take) != 0) {
+            return -1;
+        }
+        if (snapshots->every && snapshots->state.moments.count == snapshots->next_report) {
+            print_snapshot(snapshots);
+            snapshots->next_report += snapshots->every;
+        }
+        values += take;
+        n -= take;
+    }
+    poll_snapshot();
+    return 0;
+}
+
+// Snapshots are offered for streamed input (SIGUSR1 only) and whenever
+// --every or --interval asks for them
+int snapshots_wanted(const Config *config, const Input *input) {
+    return config->every > 0 || config->interval > 0 || input->file != NULL;
+}
+
+// Parse the whole input into state (and inner, if any), printing snapshots
+// of the values read so far on request. state->digest and state->hdr must
+// be set up by the caller.
+ParseStatus parse_with_snapshots(Input *input, const Config *config, ValueSink *inner,
+                                 StreamState *state) {
+    Snapshots snapshots;
+    moments_init(&state->moments);
+    snapshots.state = *state;
+    snapshots.inner = inner;
+    snapshots.every = config->every;
+    snapshots.next_report = config->every;
+    snapshots.json_output = config->json_output;
+    snapshots.precision = config->precision;
+    snapshots.percentiles = config->percentiles;
+    snapshots.n_percentiles = config->n_percentiles;
+    ValueSink sink = {snapshot_consume, &snapshots};
+
+    int wanted = snapshots_wanted(config, input);
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    if (wanted) {
+        // No SA_RESTART: a blocked read() returns EINTR so the snapshot is
+        // printed even while the pipe is idle
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = request_snapshot;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+        if (config->interval > 0) {
+            sigaction(SIGALRM, &action, NULL);
+            timer.it_interval.tv_sec = (time_t)config->interval;
+            timer.it_interval.tv_usec = (suseconds_t)((config->interval - (double)timer.it_interval.tv_sec) * 1e6);
+            timer.it_value = timer.it_interval;
+            setitimer(ITIMER_REAL, &timer, NULL);
+        }
+        active_snapshots = &snapshots;
+    }
+
+    ParseStatus status = parse_input(input, &sink);
+
+    if (wanted) {
+        active_snapshots = NULL;
+        if (config->interval > 0) {
+            memset(&timer, 0, sizeof(timer));
+            setitimer(ITIMER_REAL, &timer, NULL);
+        }
+    }
+    *state = snapshots.state;
+    return status;
+}
+
+// Make room for at least n columns
+static int table_reserve(Table *table, size_t n) {
+    if (n <= table->capacity) {
+        return 0;
+    }
+    size_t capacity = table->capacity ? table->capacity : 16;
+    while (capacity < n) {
+        capacity *= 2;
+    }
+
+    double *staged = realloc(table->staged, capacity * TABLE_BLOCK * sizeof(double));
+    if (staged) {
+        table->staged = staged;
+    }
+    size_t *n_staged = realloc(table->n_staged, capacity * sizeof(size_t));
+    if (n_staged) {
+        table->n_staged = n_staged;
+    }
+    Moments *moments = realloc(table->moments, capacity * sizeof(Moments));
+    if (moments) {
+        table->moments = moments;
+    }
+    TDigest **digests = realloc(table->digests, capacity * sizeof(TDigest*));
+    if (digests) {
+        table->digests = digests;
+    }
+    if (!staged || !n_staged || !moments || !digests) {
+        return -1;
+    }
+
+    for (size_t c = table->capacity; c < capacity; c++) {
+        table->n_staged[c] = 0;
+        moments_init(&table->moments[c]);
+        table->digests[c] = NULL;
+    }
+    table->capacity = capacity;
+    if (table->compression > 0) {
+        for (size_t c = 0; c < capacity; c++) {
+            if (!table->digests[c] && !(table->digests[c] = tdigest_create(table->compression))) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void table_flush_column(Table *table, size_t c) {
+    const double *run = table->staged + c * TABLE_BLOCK;
+    moments_add(&table->moments[c], run, table->n_staged[c]);
+    if (table->digests[c]) {
+        tdigest_add(table->digests[c], run, table->n_staged[c]);
+    }
+    table->n_staged[c] = 0;
+}
+
+// Split [p, eol) into fields. Calls field(table, column, begin, end) for
+// each and returns the number of fields.
+static size_t table_fields(Table *table, const char *p, const char *eol,
+                           int (*field)(Table *, size_t, const char *, const char *)) {
+    size_t c = 0;
+    while (1) {
+        const char *field_end;
+        if (table->delim) {
+            field_end = memchr(p, table->delim, (size_t)(eol - p));
+            if (!field_end) {
+                field_end = eol;
+            }
+        } else {
+            while (p < eol && is_blank_char(*p)) {
+                p++;
+            }
+            if (p == eol) {
+                break;
+            }
+            field_end = p;
+            while (field_end < eol && !is_blank_char(*field_end)) {
+                field_end++;
+            }
+        }
+        if (field(table, c, p, field_end) != 0) {
+            table->failed = 1;
+        }
+        c++;
+        if (field_end == eol) {
+            break;
+        }
+        p = field_end + 1;
+    }
+    return c;
+}
+
+static int table_add_field(Table *table, size_t c, const char *field, const char *field_end) {
+    double value;
+    if (!parse_field(field, field_end, &value)) {
+        return 0;   // Empty or not a number: the cell is missing
+    }
+    if (c >= table->n_columns) {
+        if (table_reserve(table, c + 1) != 0) {
+            return -1;
+        }
+        table->n_columns = c + 1;
+    }
+    table->staged[c * TABLE_BLOCK + table->n_staged[c]] = value;
+    if (++table->n_staged[c] == TABLE_BLOCK) {
+        table_flush_column(table, c);
+    }
+    return 0;
+}
+
+static int table_check_field(Table *table, size_t c, const char *field, const char *field_end) {
+    double value;
+    (void)c;
+    while (field < field_end && is_blank_char(*field)) {
+        field++;
+    }
+    if (field < field_end) {
+        if (parse_field(field, field_end, &value)) {
+            table->numeric = 1;
+        } else {
+            table->non_numeric = 1;
+        }
+    }
+    return 0;
+}
+
+static int table_name_field(Table *table, size_t c, const char *field, const char *field_end) {
+    while (field < field_end && is_blank_char(*field)) {
+        field++;
+    }
+    while (field_end > field && is_blank_char(field_end[-1])) {
+        field_end--;
+    }
+    size_t len = (size_t)(field_end - field);
+    table->names[c] = malloc(len + 1);
+    if (!table->names[c]) {
+        return -1;
+    }
+    memcpy(table->names[c], field, len);
+    table->names[c][len] = '\0';
+    return 0;
+}
+
+// The first non-empty line is a header if none of its non-empty fields is
+// a number, so a first data row with a label column is still data.
+// Returns 1 if it was (and its fields became the column names).
+static int table_header(Table *table, const char *p, const char *eol) {
+    size_t n = table_fields(table, p, eol, table_check_field);
+    if (!table->non_numeric || table->numeric) {
+        return 0;
+    }
+
+    table->names = calloc(n, sizeof(char*));
+    table->n_names = table->names ? n : 0;
+    if (!table->names) {
+        table->failed = 1;
+        return 1;
+    }
+    table_fields(table, p, eol, table_name_field);
+    return 1;
+}
+
+// BlockParser for --all-columns: every field of every line in [p, end)
+ParseStatus parse_table(const char *p, const char *end, void *ctx) {
+    Table *table = ctx;
+    while (p < end && !table->failed) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) {
+            eol = end;
+        }
+
+        if (!table->started) {
+            const char *q = p;
+            while (q < eol && is_blank_char(*q)) {
+                q++;
+            }
+            if (q < eol) {
+                table->started = 1;
+                if (!table_header(table, p, eol)) {
+                    table_fields(table, p, eol, table_add_field);
+                }
+            }
+        } else {
+            table_fields(table, p, eol, table_add_field);
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+    return table->failed ? PARSE_NOMEM : PARSE_END;
+}
+
+static void table_free(Table *table) {
+    for (size_t c = 0; c < table->capacity; c++) {
+        tdigest_free(table->digests[c]);
+    }
+    for (size_t c = 0; c < table->n_names; c++) {
+        free(table->names[c]);
+    }
+    free(table->staged);
+    free(table->n_staged);
+    free(table->moments);
+    free(table->digests);
+    free(table->names);
+}
+
+// Hand a whole text input to a line parser: the mapping in one call, or a
+// stream in blocks of complete lines
+ParseStatus parse_input_lines(Input *input, BlockParser parse, void *ctx) {
+    if (input->file) {
+        return read_blocks(input, 1, parse, ctx);
+    }
+    if (input->size == 0) {
+        return PARSE_END;
+    }
+    char *data = map_input(input->fd, input->size);
+    if (!data) {
+        return PARSE_NOMEM;
+    }
+    ParseStatus status = parse(data, data + input->size, ctx);
+    munmap(data, input->size);
+    return status;
+}
+
+// --all-columns: one pass over the input, one Stats record per column.
+// Returns the exit status.
+int table_stats(Input *input, const Config *config) {
+    Table table;
+    memset(&table, 0, sizeof(table));
+    table.delim = config->columns.delim;
+    table.compression = config->tdigest;
+
+    if (parse_input_lines(input, parse_table, &table) == PARSE_NOMEM) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        table_free(&table);
+        return 1;
+    }
+
+    for (size_t c = 0; c < table.n_columns; c++) {
+        table_flush_column(&table, c);
+    }
+    if (table.n_columns == 0) {
+        fprintf(stderr, "Error: No valid numbers found in input\n");
+        table_free(&table);
+        return 1;
+    }
+
+    if (config->json_output) {
+        print_table_json(&table, config->precision);
+    } else {
+        print_table_text(&table, config->precision);
+    }
+    table_free(&table);
+    return 0;
+}
+
+// Copy len bytes of str into the arena, NUL-terminated
+char* arena_copy(Arena *arena, const char *str, size_t len) {
+    ArenaChunk *chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < len + 1) {
+        size_t size = len + 1 > ARENA_CHUNK ? len + 1 : ARENA_CHUNK;
+        chunk = malloc(sizeof(ArenaChunk) + size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = arena->head;
+        chunk->used = 0;
+        chunk->size = size;
+        arena->head = chunk;
+    }
+    char *copy = chunk->data + chunk->used;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    chunk->used += len + 1;
+    return copy;
+}
+
+void arena_free(Arena *arena) {
+    while (arena->head) {
+        ArenaChunk *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+// FNV-1a
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Double the slot array and re-insert every group by its stored hash
+static int group_table_grow(GroupTable *groups) {
+    size_t capacity = groups->capacity ? groups->capacity * 2 : 1024;
+    Group *slots = calloc(capacity, sizeof(Group));
+    if (!slots) {
+        return -1;
+    }
+    for (size_t i = 0; i < groups->capacity; i++) {
+        Group *group = &groups->slots[i];
+        if (group->key) {
+            size_t j = group->hash & (capacity - 1);
+            while (slots[j].key) {
+                j = (j + 1) & (capacity - 1);
+            }
+            slots[j] = *group;
+        }
+    }
+    free(groups->slots);
+    groups->slots = slots;
+    groups->capacity = capacity;
+    return 0;
+}
+
+// Find the group for a key, adding it if it is new. Returns NULL when out
+// of memory.
+Group* group_lookup(GroupTable *groups, const char *key, size_t len) {
+    if ((groups->n_groups + 1) * 4 > groups->capacity * 3 && group_table_grow(groups) != 0) {
+        return NULL;
+    }
+
+    uint64_t hash = hash_key(key, len);
+    size_t mask = groups->capacity - 1;
+    size_t i = hash & mask;
+    while (groups->slots[i].key) {
+        Group *group = &groups->slots[i];
+        if (group->hash == hash && group->key_len == len && memcmp(group->key, key, len) == 0) {
+            return group;
+        }
+        i = (i + 1) & mask;
+    }
+
+    Group *group = &groups->slots[i];
+    group->digest = NULL;
+    if (groups->compression > 0 && !(group->digest = tdigest_create(groups->compression))) {
+        return NULL;
+    }
+    group->key = arena_copy(&groups->arena, key, len);
+    if (!group->key) {
+        tdigest_free(group->digest);
+        return NULL;
+    }
+    group->hash = hash;
+    group->key_len = len;
+    moments_init(&group->moments);
+    groups->n_groups++;
+    return group;
+}
+
+// BlockParser for --group-by: fold each line's value into its key's group.
+// Lines without a key or a numeric value (headers, blanks) are skipped.
+ParseStatus parse_groups(const char *p, const char *end, void *ctx) {
+    GroupTable *groups = ctx;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) {
+            eol = end;
+        }
+
+        const char *key_end, *value_end;
+        const char *key = find_field(p, eol, &groups->key, &key_end);
+        const char *value = find_field(p, eol, &groups->value, &value_end);
+        double x;
+        if (key && value && parse_field(value, value_end, &x)) {
+            while (key < key_end && is_blank_char(*key)) {
+                key++;
+            }
+            while (key_end > key && is_blank_char(key_end[-1])) {
+                key_end--;
+            }
+            Group *group = group_lookup(groups, key, (size_t)(key_end - key));
+            if (!group) {
+                return PARSE_NOMEM;
+            }
+            moments_push(&group->moments, x);
+            if (group->digest) {
+                tdigest_add(group->digest, &x, 1);
+            }
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+    return PARSE_END;
+}
+
+static int compare_group_keys(const void *a, const void *b) {
+    return strcmp((*(Group *const *)a)->key, (*(Group *const *)b)->key);
+}
+
+static void group_table_free(GroupTable *groups) {
+    for (size_t i = 0; i < groups->capacity; i++) {
+        if (groups->slots[i].key) {
+            tdigest_free(groups->slots[i].digest);
+        }
+    }
+    free(groups->slots);
+    arena_free(&groups->arena);
+}
+
+// --group-by: one Stats record per distinct key, in key order. Returns the
+// exit status.
+int group_stats(Input *input, const Config *config) {
+    GroupTable groups;
+    memset(&groups, 0, sizeof(groups));
+    groups.key = config->columns;
+    groups.key.column = config->columns.key;
+    groups.value = config->columns;
+    groups.compression = config->tdigest;
+
+    Group **sorted = NULL;
+    if (parse_input_lines(input, parse_groups, &groups) == PARSE_NOMEM ||
+        (groups.n_groups > 0 && !(sorted = malloc(groups.n_groups * sizeof(Group*))))) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        group_table_free(&groups);
+        return 1;
+    }
+    if (groups.n_groups == 0) {
+        fprintf(stderr, "Error: No valid numbers found in input\n");
+        group_table_free(&groups);
+        return 1;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < groups.capacity; i++) {
+        if (groups.slots[i].key) {
+            sorted[n++] = &groups.slots[i];
+        }
+    }
+    qsort(sorted, n, sizeof(Group*), compare_group_keys);
+
+    if (config->json_output) {
+        print_groups_json(sorted, n, config->precision);
+    } else {
+        print_groups_text(sorted, n, config->precision);
+    }
+    free(sorted);
+    group_table_free(&groups);
+    return 0;
+}
+
+static inline DequeEntry* deque_at(Deque *deque, size_t i) {
+    size_t slot = deque->head + i;
+    return &deque->items[slot < deque->capacity ? slot : slot - deque->capacity];
+}
+
+// Drop the entries that left the window, then the ones the new value makes
+// irrelevant (worse_than(back, value) is true), then append the new value.
+// Each value is pushed and popped at most once: O(1) amortized.
+static inline void deque_push(Deque *deque, double value, uint64_t seq, uint64_t oldest,
+                              int is_max) {
+    while (deque->len > 0 && deque_at(deque, 0)->seq < oldest) {
+        deque->head = deque->head + 1 < deque->capacity ? deque->head + 1 : 0;
+        deque->len--;
+    }
+    while (deque->len > 0) {
+        double back = deque_at(deque, deque->len - 1)->value;
+        if (is_max ? back > value : back < value) {
+            break;
+        }
+        deque->len--;
+    }
+    DequeEntry *entry = deque_at(deque, deque->len++);
+    entry->value = value;
+    entry->seq = seq;
+}
+
+// Recompute the window's mean and M2 from the ring. Done once per size
+// evictions, so rounding drift from the evict updates cannot build up.
+static void window_resync(Window *window) {
+    Moments moments;
+    moments_init(&moments);
+    if (window->count < window->size) {
+        moments_add(&moments, window->ring, window->count);
+    } else {
+        moments_add(&moments, window->ring + window->pos, window->size - window->pos);
+        moments_add(&moments, window->ring, window->pos);
+    }
+    window->mean = moments.mean;
+    window->m2 = moments.m2;
+    window->evictions = 0;
+}
+
+// Build an empty skiplist whose nodes can hold capacity values at once
+SkipList* skiplist_create(size_t capacity) {
+    SkipList *list = calloc(1, sizeof(SkipList));
+    if (!list) {
+        return NULL;
+    }
+    list->max_level = 1;
+    while (list->max_level < SKIP_MAX_LEVEL && ((size_t)1 << list->max_level) < capacity) {
+        list->max_level++;
+    }
+    list->random = 0x9E3779B97F4A7C15ULL;
+
+    // Node levels are drawn once: level k with probability 2^-k
+    list->nodes = calloc(capacity, sizeof(SkipNode));
+    size_t n_links = (size_t)list->max_level;
+    for (size_t i = 0; list->nodes && i < capacity; i++) {
+        int level = 1;
+        while (level < list->max_level) {
+            list->random ^= list->random << 13;
+            list->random ^= list->random >> 7;
+            list->random ^= list->random << 17;
+            if (!(list->random & 1)) {
+                break;
+            }
+            level++;
+        }
+        list->nodes[i].level = level;
+        n_links += (size_t)level;
+    }
+    list->links = malloc(n_links * sizeof(SkipLink));
+    if (!list->nodes || !list->links) {
+        skiplist_free(list);
+        return NULL;
+    }
+
+    SkipLink *link = list->links;
+    list->head.level = list->max_level;
+    list->head.links = link;
+    for (int i = 0; i < list->max_level; i++) {
+        link[i].next = NULL;
+        link[i].width = 1;
+    }
+    link += list->max_level;
+    for (size_t i = 0; i < capacity; i++) {
+        list->nodes[i].links = link;
+        link += list->nodes[i].level;
+    }
+    return list;
+}
+
+void skiplist_free(SkipList *list) {
+    if (!list) {
+        return;
+    }
+    free(list->nodes);
+    free(list->links);
+    free(list);
+}
+
+// Whether node sorts before the key (value, seq). NaNs sort after numbers.
+static inline int skip_before(const SkipNode *node, double value, uint64_t seq) {
+    if (node->value < value) return 1;
+    if (node->value > value) return 0;
+    int node_nan = isnan(node->value);
+    int value_nan = isnan(value);
+    if (node_nan != value_nan) {
+        return value_nan;
+    }
+    return node->seq < seq;
+}
+
+// For every level, the last node before the key and its rank (head = 0)
+static void skip_find(SkipList *list, double value, uint64_t seq,
+                      SkipNode **chain, size_t *ranks) {
+    SkipNode *node = &list->head;
+    size_t rank = 0;
+    for (int i = list->max_level - 1; i >= 0; i--) {
+        while (node->links[i].next && skip_before(node->links[i].next, value, seq)) {
+            rank += node->links[i].width;
+            node = node->links[i].next;
+        }
+        chain[i] = node;
+        ranks[i] = rank;
+    }
+}
+
+void skiplist_insert(SkipList *list, SkipNode *node) {
+    SkipNode *chain[SKIP_MAX_LEVEL];
+    size_t ranks[SKIP_MAX_LEVEL];
+    skip_find(list, node->value, node->seq, chain, ranks);
+
+    for (int i = 0; i < list->max_level; i++) {
+        SkipLink *prev = &chain[i]->links[i];
+        if (i < node->level) {
+            size_t steps = ranks[0] - ranks[i];
+            node->links[i].next = prev->next;
+            node->links[i].width = prev->width - steps;
+            prev->next = node;
+            prev->width = steps + 1;
+        } else {
+            prev->width++;
+        }
+    }
+    list->size++;
+}
+
+// Remove a node that is in the list
+void skiplist_remove(SkipList *list, SkipNode *node) {
+    SkipNode *chain[SKIP_MAX_LEVEL];
+    size_t ranks[SKIP_MAX_LEVEL];
+    skip_find(list, node->value, node->seq, chain, ranks);
+
+    for (int i = 0; i < list->max_level; i++) {
+        SkipLink *prev = &chain[i]->links[i];
+        if (i < node->level) {
+            prev->width += node->links[i].width - 1;
+            prev->next = node->links[i].next;
+        } else {
+            prev->width--;
+        }
+    }
+    list->size--;
+}
+
+// The node of 0-based rank in sorted order (rank < size)
+SkipNode* skiplist_select(SkipList *list, size_t rank) {
+    SkipNode *node = &list->head;
+    rank++;
+    for (int i = list->max_level - 1; i >= 0; i--) {
+        while (node->links[i].next && node->links[i].width <= rank) {
+            rank -= node->links[i].width;
+            node = node->links[i].next;
+        }
+    }
+    return node;
+}
+
+// A percentile of the window, interpolated as get_percentile() does
+static double window_percentile(Window *window, double percentile) {
+    size_t lower;
+    double weight;
+    int interpolate = percentile_rank(window->order->size, percentile, &lower, &weight);
+    SkipNode *node = skiplist_select(window->order, lower);
+    if (!interpolate) {
+        return node->value;
+    }
+    return node->value * (1 - weight) + node->links[0].next->value * weight;
+}
+
+// ValueSink callback for --window: O(1) work per value, plus O(log N) for
+// the order-statistic skiplist with --percentiles
+int window_consume(void *ctx, const double *values, size_t n) {
+    Window *window = ctx;
+    for (size_t i = 0; i < n; i++) {
+        double x = values[i];
+        int evict = window->count == window->size;
+        if (evict) {
+            // Evict the oldest value (inverse Welford update)
+            double old = window->ring[window->pos];
+            window->count--;
+            if (window->count == 0) {
+                window->mean = window->m2 = 0.0;
+            } else {
+                double delta = old - window->mean;
+                window->mean -= delta / (double)window->count;
+                window->m2 -= delta * (old - window->mean);
+                if (window->m2 < 0) {
+                    window->m2 = 0;
+                }
+            }
+            window->evictions++;
+        }
+
+        if (window->order) {
+            // The slot's node leaves with the old value, comes back with x
+            SkipNode *node = window->slot_nodes[window->pos];
+            if (evict) {
+                skiplist_remove(window->order, node);
+            }
+            node->value = x;
+            node->seq = window->seen;
+            skiplist_insert(window->order, node);
+        }
+
+        window->ring[window->pos] = x;
+        window->pos = window->pos + 1 < window->size ? window->pos + 1 : 0;
+        window->count++;
+        double delta = x - window->mean;
+        window->mean += delta / (double)window->count;
+        window->m2 += delta * (x - window->mean);
+        if (window->evictions >= window->size) {
+            window_resync(window);
+        }
+
+        uint64_t seq = window->seen++;
+        uint64_t oldest = window->seen > window->size ? window->seen - window->size : 0;
+        deque_push(&window->min, x, seq, oldest, 0);
+        deque_push(&window->max, x, seq, oldest, 1);
+
+        if (window->seen % window->every == 0) {
+            print_window(window);
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
+
+// --window: rolling statistics over the last config->window values, one
+// line (or NDJSON record) every config->every values. Returns the exit
+// status.
+int window_stats(Input *input, const Config *config) {
+    Window window;
+    memset(&window, 0, sizeof(window));
+    window.size = config->window;
+    window.every = config->every ? config->every : 1;
+    window.json_output = config->json_output;
+    window.precision = config->precision;
+    window.ring = malloc(window.size * sizeof(double));
+    window.min.items = malloc(window.size * sizeof(DequeEntry));
+    window.max.items = malloc(window.size * sizeof(DequeEntry));
+    window.min.capacity = window.max.capacity = window.size;
+    window.percentiles = config->percentiles;
+    window.n_percentiles = config->n_percentiles;
+
+    int failed = !window.ring || !window.min.items || !window.max.items;
+    if (window.n_percentiles > 0) {
+        window.order = skiplist_create(window.size);
+        window.slot_nodes = malloc(window.size * sizeof(SkipNode*));
+        failed |= !window.order || !window.slot_nodes;
+        for (size_t i = 0; !failed && i < window.size; i++) {
+            window.slot_nodes[i] = &window.order->nodes[i];
+        }
+    }
+
+    int status = 0;
+    ValueSink sink = {window_consume, &window};
+    if (failed || parse_input(input, &sink) == PARSE_NOMEM) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        status = 1;
+    } else if (window.seen == 0) {
+        fprintf(stderr, "Error: No valid numbers found in input\n");
+        status = 1;
+    } else if (window.seen % window.every != 0) {
+        print_window(&window);  // The last values, not yet reported
+    }
+
+    free(window.ring);
+    free(window.min.items);
+    free(window.max.items);
+    skiplist_free(window.order);
+    free(window.slot_nodes);
+    return status;
+}
+
+// Read exactly n digits
+static inline const char* parse_fixed_digits(const char *p, const char *end, int n, int *out) {
+    int value = 0;
+    for (int i = 0; i < n; i++) {
+        if (p == end || !is_digit_char(*p)) {
+            return NULL;
+        }
+        value = value * 10 + (*p++ - '0');
+    }
+    *out = value;
+    return p;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date (Hinnant's
+// days_from_civil)
+static int64_t days_from_civil(int64_t y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// Days in a month of the proleptic Gregorian calendar
+static int days_in_month(int y, int m) {
+    static const int days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    return days[m - 1] + (m == 2 && leap);
+}
+
+// Parse an epoch or ISO-8601 timestamp into seconds since the epoch (UTC).
+// Epochs may have a fraction; 12 to 14 integer digits are read as
+// milliseconds, 15 to 17 as microseconds, 18 or 19 as nanoseconds. ISO
+// dates are YYYY-MM-DD, optionally followed by 'T' or one space and
+// HH:MM[:SS[.frac]], then 'Z' or an offset like +02:00. Without an offset
+// the time is UTC. Returns the position after the timestamp, or NULL.
+const char* parse_timestamp(const char *p, const char *end, double *seconds) {
+    const char *start = p;
+    uint64_t whole = 0;
+    int digits = 0;
+    while (p < end && is_digit_char(*p) && digits < 19) {
+        whole = whole * 10 + (uint64_t)(*p++ - '0');
+        digits++;
+    }
+    if (digits == 0) {
+        return NULL;
+    }
+
+    if (digits != 4 || p == end || *p != '-') {
+        // Epoch, possibly with a fraction
+        double fraction = 0.0;
+        if (p < end && *p == '.') {
+            double scale = 0.1;
+            for (p++; p < end && is_digit_char(*p); p++) {
+                fraction += (*p - '0') * scale;
+                scale *= 0.1;
+            }
+        }
+        if (p < end && is_digit_char(*p)) {
+            return NULL;    // More than 19 digits
+        }
+        double unit = digits <= 11 ? 1 : digits <= 14 ? 1e3 : digits <= 17 ? 1e6 : 1e9;
+        *seconds = ((double)whole + fraction) / unit;
+        return p;
+    }
+
+    int year, month, day, hour = 0, minute = 0, second = 0;
+    double fraction = 0.0;
+    if (!parse_fixed_digits(start, end, 4, &year) ||
+        !(p = parse_fixed_digits(p + 1, end, 2, &month)) || p == end || *p != '-' ||
+        !(p = parse_fixed_digits(p + 1, end, 2, &day)) ||
+        month < 1 || month > 12 || day < 1 || day > days_in_month(year, month)) {
+        return NULL;
+    }
+
+    if (p + 1 < end && (*p == 'T' || *p == 't' || *p == ' ') && is_digit_char(p[1])) {
+        const char *q = parse_fixed_digits(p + 1, end, 2, &hour);
+        if (!q || q == end || *q != ':' || !(q = parse_fixed_digits(q + 1, end, 2, &minute))) {
+            return NULL;
+        }
+        if (q < end && *q == ':') {
+            if (!(q = parse_fixed_digits(q + 1, end, 2, &second))) {
+                return NULL;
+            }
+            if (q < end && (*q == '.' || *q == ',')) {
+                double scale = 0.1;
+                for (q++; q < end && is_digit_char(*q); q++) {
+                    fraction += (*q - '0') * scale;
+                    scale *= 0.1;
+                }
+            }
+        }
+        if (hour > 23 || minute > 59 || second > 60) {
+            return NULL;
+        }
+        p = q;
+    }
+
+    int64_t offset = 0;
+    if (p < end && (*p == 'Z' || *p == 'z')) {
+        p++;
+    } else if (p < end && (*p == '+' || *p == '-') && p + 1 < end && is_digit_char(p[1])) {
+        int sign = *p == '-' ? -1 : 1;
+        int off_hour, off_minute = 0;
+        const char *q = parse_fixed_digits(p + 1, end, 2, &off_hour);
+        if (!q) {
+            return NULL;
+        }
+        if (q < end && *q == ':') {
+            q++;
+        }
+        if (q < end && is_digit_char(*q) && !(q = parse_fixed_digits(q, end, 2, &off_minute))) {
+            return NULL;
+        }
+        offset = sign * (off_hour * 3600 + off_minute * 60);
+        p = q;
+    }
+
+    int64_t days = days_from_civil(year, month, day);
+    *seconds = (double)(days * 86400 + hour * 3600 + minute * 60 + second - offset) + fraction;
+    return p;
+}
+
+// The field that follows position p on a line
+static const char* next_field(const char *p, const char *eol, char delim, const char **field_end) {
+    if (delim) {
+        p = memchr(p, delim, (size_t)(eol - p));
+        if (!p) {
+            return NULL;
+        }
+        p++;
+        const char *q = memchr(p, delim, (size_t)(eol - p));
+        *field_end = q ? q : eol;
+        return p;
+    }
+    while (p < eol && is_blank_char(*p)) {
+        p++;
+    }
+    if (p == eol) {
+        return NULL;
+    }
+    const char *q = p;
+    while (q < eol && !is_blank_char(*q)) {
+        q++;
+    }
+    *field_end = q;
+    return p;
+}
+
+// Print the open bucket and start an empty one
+static void bucket_flush(Buckets *buckets) {
+    if (buckets->open) {
+        print_bucket(buckets);
+    }
+    buckets->open = 0;
+    moments_init(&buckets->moments);
+    if (buckets->digest) {
+        tdigest_reset(buckets->digest);
+    }
+}
+
+// BlockParser for --time-col: add each line's value to its time bucket
+ParseStatus parse_buckets(const char *p, const char *end, void *ctx) {
+    Buckets *buckets = ctx;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) {
+            eol = end;
+        }
+
+        const char *time_end, *value_end;
+        const char *time = find_field(p, eol, &buckets->time, &time_end);
+        while (time && time < time_end && is_blank_char(*time)) {
+            time++;
+        }
+        double seconds;
+        const char *after = time ? parse_timestamp(time, eol, &seconds) : NULL;
+        if (after && after < eol && *after != buckets->time.delim && !is_blank_char(*after)) {
+            after = NULL;   // Something else is glued to the timestamp
+        }
+
+        const char *value = NULL;
+        if (after) {
+            value = buckets->value.column ? find_field(p, eol, &buckets->value, &value_end)
+                                          : next_field(after, eol, buckets->value.delim, &value_end);
+        }
+        double x;
+        if (value && parse_field(value, value_end, &x)) {
+            int64_t index = (int64_t)floor(seconds / (double)buckets->width);
+            if (buckets->open && index < buckets->index) {
+                buckets->late++;
+            } else {
+                if (buckets->open && index > buckets->index) {
+                    bucket_flush(buckets);
+                }
+                buckets->open = 1;
+                buckets->index = index;
+                moments_push(&buckets->moments, x);
+                if (buckets->digest) {
+                    tdigest_add(buckets->digest, &x, 1);
+                }
+            }
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+    fflush(stdout);
+    return PARSE_END;
+}
+
+// --time-col: one report per time bucket, printed as soon as the input
+// moves past it. Returns the exit status.
+int bucket_stats(Input *input, const Config *config) {
+    Buckets buckets;
+    memset(&buckets, 0, sizeof(buckets));
+    buckets.time = config->columns;
+    buckets.time.column = config->columns.time;
+    buckets.value = config->columns;
+    buckets.width = config->bucket;
+    buckets.json_output = config->json_output;
+    buckets.precision = config->precision;
+    moments_init(&buckets.moments);
+
+    int status = 0;
+    if (config->tdigest > 0 && !(buckets.digest = tdigest_create(config->tdigest))) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    if (parse_input_lines(input, parse_buckets, &buckets) == PARSE_NOMEM) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        status = 1;
+    } else if (!buckets.open) {
+        fprintf(stderr, "Error: No valid numbers found in input\n");
+        status = 1;
+    } else {
+        bucket_flush(&buckets);
+    }
+    fflush(stdout);
+    if (buckets.late > 0) {
+        fprintf(stderr, "Warning: Dropped %zu out-of-order line%s for buckets already printed\n",
+                buckets.late, buckets.late == 1 ? "" : "s");
+    }
+    tdigest_free(buckets.digest);
+    return status;
+}
+
+// Build an empty t-digest. Memory is fixed by the compression: about
+// compression * 160 bytes, independent of how many values are added.
+TDigest* tdigest_create(double compression) {
+    TDigest *td = calloc(1, sizeof(TDigest));
+    if (!td) {
+        return NULL;
+    }
+    td->compression = compression;
+    td->max_centroids = (size_t)(2 * ceil(compression)) + 8;
+    td->buffer_size = (size_t)(4 * ceil(compression));
+    td->centroids = malloc(td->max_centroids * sizeof(Centroid));
+    td->buffer = malloc(td->buffer_size * sizeof(double));
+    td->scratch = malloc((td->max_centroids + td->buffer_size) * sizeof(Centroid));
+    td->min = INFINITY;
+    td->max = -INFINITY;
+    if (!td->centroids || !td->buffer || !td->scratch) {
+        tdigest_free(td);
+        return NULL;
+    }
+    return td;
+}
+
+// Empty the digest, keeping its memory
+void tdigest_reset(TDigest *td) {
+    td->n_centroids = 0;
+    td->n_buffer = 0;
+    td->total = 0;
+    td->min = INFINITY;
+    td->max = -INFINITY;
+}
+
+void tdigest_free(TDigest *td) {
+    if (!td) {
+        return;
+    }
+    free(td->centroids);
+    free(td->buffer);
+    free(td->scratch);
+    free(td);
+}
+
+// Largest cumulative quantile a centroid starting at q0 may reach: the
+// k1 scale function k(q) = compression / (2 pi) * asin(2q - 1) may grow
+// by at most 1 per centroid, which keeps centroids small near the tails
+static double tdigest_q_limit(double compression, double q0) {
+    double angle = asin(2.0 * q0 - 1.0) + 2.0 * M_PI / compression;
+    if (angle >= M_PI / 2) {
+        return 1.0;
+    }
+    return (sin(angle) + 1.0) / 2.0;
+}
+
+// Sort the buffered values, merge them with the existing centroids and
+// re-compress everything in one left-to-right pass
+static void tdigest_flush(TDigest *td) {
+    if (td->n_buffer == 0) {
+        return;
+    }
+    sort_doubles(td->buffer, td->n_buffer, 1);
+
+    // Merge the two sorted runs into scratch
+    size_t i = 0, j = 0, n = 0;
+    while (i < td->n_centroids || j < td->n_buffer) {
+        if (j == td->n_buffer ||
+            (i < td->n_centroids && td->centroids[i].mean <= td->buffer[j])) {
+            td->scratch[n++] = td->centroids[i++];
+        } else {
+            td->scratch[n].mean = td->buffer[j++];
+            td->scratch[n++].weight = 1.0;
+        }
+    }
+    td->total += (double)td->n_buffer;
+    td->n_buffer = 0;
+
+    Centroid current = td->scratch[0];
+    double weight_before = 0.0;
+    double q_limit = tdigest_q_limit(td->compression, 0.0);
+    td->n_centroids = 0;
+
+    for (size_t k = 1; k < n; k++) {
+        Centroid next = td->scratch[k];
+        double q = (weight_before + current.weight + next.weight) / td->total;
+        if (q <= q_limit) {
+            current.weight += next.weight;
+            current.mean += (next.mean - current.mean) * next.weight / current.weight;
+        } else {
+            td->centroids[td->n_centroids++] = current;
+            weight_before += current.weight;
+            q_limit = tdigest_q_limit(td->compression, weight_before / td->total);
+            current = next;
+        }
+    }
+    td->centroids[td->n_centroids++] = current;
+}
+
+void tdigest_add(TDigest *td, const double *values, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (isnan(values[i])) {
+            continue;
+        }
+        if (values[i] < td->min) td->min = values[i];
+        if (values[i] > td->max) td->max = values[i];
+        td->buffer[td->n_buffer++] = values[i];
+        if (td->n_buffer == td->buffer_size) {
+            tdigest_flush(td);
+        }
+    }
+}
+
+// Estimate a percentile with the same convention as get_percentile(): the
+// i-th smallest value sits at rank i + 0.5, and ranks between centroid
+// centres are interpolated linearly. When rank_error is given, it receives
+// how far (as a fraction of the count) the true rank of the returned value
+// may be from the requested one; singleton centroids are exact.
+double tdigest_percentile(TDigest *td, double percentile, double *rank_error) {
+    tdigest_flush(td);
+    if (rank_error) {
+        *rank_error = 0.0;
+    }
+    if (td->n_centroids == 0) {
+        return NAN;
+    }
+    if (td->n_centroids == 1) {
+        return td->centroids[0].mean;
+    }
+
+    double target = percentile * (td->total - 1.0) + 0.5;
+    const Centroid *c = td->centroids;
+    size_t last = td->n_centroids - 1;
+
+    // Below the first centre or above the last one: interpolate to min/max
+    if (target < c[0].weight / 2) {
+        if (rank_error) {
+            *rank_error = (c[0].weight - 1.0) / 2.0 / td->total;
+        }
+        return td->min + (c[0].mean - td->min) * target / (c[0].weight / 2);
+    }
+    if (target > td->total - c[last].weight / 2) {
+        if (rank_error) {
+            *rank_error = (c[last].weight - 1.0) / 2.0 / td->total;
+        }
+        double into = target - (td->total - c[last].weight / 2);
+        return c[last].mean + (td->max - c[last].mean) * into / (c[last].weight / 2);
+    }
+
+    double centre = c[0].weight / 2;
+    for (size_t i = 0; i < last; i++) {
+        double gap = (c[i].weight + c[i + 1].weight) / 2;
+        if (target <= centre + gap) {
+            if (rank_error) {
+                double widest = c[i].weight > c[i + 1].weight ? c[i].weight : c[i + 1].weight;
+                *rank_error = (widest - 1.0) / 2.0 / td->total;
+            }
+            double weight = (target - centre) / gap;
+            return c[i].mean * (1 - weight) + c[i + 1].mean * weight;
+        }
+        centre += gap;
+    }
+    return c[last].mean;
+}
+
+// Fill median/Q1/Q3 from the digest; rank_error is the worst of the three
+// Median, quartiles and the requested percentiles (in percent) from the
+// digest, with the worst rank error of all the estimates
+void stats_from_tdigest(TDigest *td, const double *percentiles, size_t n, Stats *stats) {
+    double err_median, err_q1, err_q3;
+    stats->has_quantiles = 1;
+    stats->median = tdigest_percentile(td, 0.50, &err_median);
+    stats->q1 = tdigest_percentile(td, 0.25, &err_q1);
+    stats->q3 = tdigest_percentile(td, 0.75, &err_q3);
+    stats->rank_error = fmax(err_median, fmax(err_q1, err_q3));
+    stats->n_percentiles = n;
+    for (size_t i = 0; i < n; i++) {
+        double err;
+        stats->percentiles[i] = percentiles[i];
+        stats->percentile_values[i] = tdigest_percentile(td, percentiles[i] / 100, &err);
+        stats->rank_error = fmax(stats->rank_error, err);
+    }
+}
+
+// Empty HDR histogram keeping sigfigs significant decimal digits: a
+// bucket spans at most 10^-sigfigs of its values
+HdrHistogram* hdr_create(int sigfigs) {
+    HdrHistogram *hdr = calloc(1, sizeof(HdrHistogram));
+    if (!hdr) {
+        return NULL;
+    }
+    hdr->sub_bits = (int)ceil(sigfigs * log2(10.0));
+    return hdr;
+}
+
+void hdr_free(HdrHistogram *hdr) {
+    if (!hdr) {
+        return;
+    }
+    for (size_t e = 0; e < HDR_OCTAVES; e++) {
+        free(hdr->positive.counts[e]);
+        free(hdr->negative.counts[e]);
+    }
+    free(hdr);
+}
+
+// Record values: each costs a shift, a mask and two increments, and
+// memory only grows when a value lands in a new power of two. Memory is
+// bounded by the exponent range, whatever the data. Returns -1 if out of
+// memory.
+int hdr_add(HdrHistogram *hdr, const double *values, size_t n) {
+    int shift = 52 - hdr->sub_bits;
+    uint64_t mask = ((uint64_t)1 << hdr->sub_bits) - 1;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t bits;
+        memcpy(&bits, &values[i], sizeof(bits));
+        uint64_t magnitude = bits & ~(1ULL << 63);
+        if (magnitude > 0x7ff0000000000000ULL) {
+            continue;   // NaN
+        }
+        hdr->total++;
+        if (magnitude == 0) {
+            hdr->zeros++;
+            continue;
+        }
+        HdrSide *side = (bits >> 63) ? &hdr->negative : &hdr->positive;
+        uint64_t key = magnitude >> shift;
+        size_t octave = (size_t)(key >> hdr->sub_bits);
+        if (!side->counts[octave]) {
+            side->counts[octave] = calloc((size_t)mask + 1, sizeof(uint64_t));
+            if (!side->counts[octave]) {
+                return -1;
+            }
+        }
+        side->counts[octave][key & mask]++;
+        side->totals[octave]++;
+    }
+    return 0;
+}
+
+// Middle of the values whose magnitude has this key
+static double hdr_key_value(uint64_t key, int sub_bits) {
+    int shift = 52 - sub_bits;
+    uint64_t lo_bits = key << shift, hi_bits = (key + 1) << shift;
+    double lo, hi;
+    memcpy(&lo, &lo_bits, sizeof(lo));
+    if (hi_bits > 0x7ff0000000000000ULL) {
+        return lo;  // Infinity
+    }
+    memcpy(&hi, &hi_bits, sizeof(hi));
+    return lo + (hi - lo) / 2;
+}
+
+// Estimate of the value at a 0-based rank (in sorted order) among the
+// recorded values: negative buckets from the most negative, then zeros,
+// then positive buckets. Octaves whose values all lie before the rank are
+// skipped by their totals, so only one octave's buckets are scanned.
+double hdr_value_at_rank(const HdrHistogram *hdr, uint64_t rank) {
+    int sub_bits = hdr->sub_bits;
+    size_t buckets = (size_t)1 << sub_bits;
+    uint64_t seen = 0;
+    const HdrSide *neg = &hdr->negative, *pos = &hdr->positive;
+    for (size_t e = HDR_OCTAVES; e-- > 0;) {
+        if (rank >= seen + neg->totals[e]) {
+            seen += neg->totals[e];
+            continue;
+        }
+        for (size_t i = buckets; i-- > 0;) {
+            seen += neg->counts[e][i];
+            if (rank < seen) {
+                return -hdr_key_value(((uint64_t)e << sub_bits) + i, sub_bits);
+            }
+        }
+    }
+    seen += hdr->zeros;
+    if (rank < seen) {
+        return 0.0;
+    }
+    for (size_t e = 0; e < HDR_OCTAVES; e++) {
+        if (rank >= seen + pos->totals[e]) {
+            seen += pos->totals[e];
+            continue;
+        }
+        for (size_t i = 0; i < buckets; i++) {
+            seen += pos->counts[e][i];
+            if (rank < seen) {
+                return hdr_key_value(((uint64_t)e << sub_bits) + i, sub_bits);
+            }
+        }
+    }
+    return NAN;
+}
+
+// A percentile (0 to 1) interpolated between ranks as get_percentile()
+// does. The extreme ranks are the exact min and max, and the other
+// estimates are kept within them.
+double hdr_percentile(const HdrHistogram *hdr, double percentile, double min, double max) {
+    size_t lower;
+    double weight;
+    int interpolate = percentile_rank((size_t)hdr->total, percentile, &lower, &weight);
+    double values[2];
+    for (size_t k = 0; k < 2; k++) {
+        size_t rank = lower + k;
+        if (rank == 0) {
+            values[k] = min;
+        } else if (rank + 1 >= hdr->total) {
+            values[k] = max;
+        } else {
+            values[k] = fmin(fmax(hdr_value_at_rank(hdr, rank), min), max);
+        }
+        if (!interpolate) {
+            return values[0];
+        }
+    }
+    return values[0] * (1 - weight) + values[1] * weight;
+}
+
+// Median, quartiles and the requested percentiles (in percent) from the
+// histogram; stats must already hold the exact min and max
+void stats_from_hdr(const HdrHistogram *hdr, const double *percentiles, size_t n, Stats *stats) {
+    stats->has_quantiles = 1;
+    stats->median = hdr_percentile(hdr, 0.50, stats->min, stats->max);
+    stats->q1 = hdr_percentile(hdr, 0.25, stats->min, stats->max);
+    stats->q3 = hdr_percentile(hdr, 0.75, stats->min, stats->max);
+    stats->value_error = ldexp(1.0, -hdr->sub_bits - 1);
+    stats->n_percentiles = n;
+    for (size_t i = 0; i < n; i++) {
+        stats->percentiles[i] = percentiles[i];
+        stats->percentile_values[i] = hdr_percentile(hdr, percentiles[i] / 100,
+                                                     stats->min, stats->max);
+    }
+}
+
+// NaNs compare above everything, as in radix_sort_double()
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    if (isnan(x) || isnan(y)) {
+        return !!isnan(x) - !!isnan(y);
+    }
+    return (x > y) - (x < y);  // Returns -1, 0, or 1
+}
+
+// Map a double's bit pattern to an unsigned key with the same order:
+// negatives have all bits flipped, positives get the sign bit set. Every
+// NaN maps to the largest key, so NaNs always end up last.
+static inline uint64_t double_to_key(double x) {
+    uint64_t bits;
+    if (isnan(x)) {
+        return UINT64_MAX;
+    }
+    memcpy(&bits, &x, sizeof(bits));
+    return (bits >> 63) ? ~bits : bits | (1ULL << 63);
+}
+
+static inline double key_to_double(uint64_t key) {
+    uint64_t bits = (key >> 63) ? key & ~(1ULL << 63) : ~key;
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+// LSD radix sort over RADIX_BITS-bit digits. All digit histograms are
+// built in one pass, and digits that are the same for every key (such as
+// the sign and exponent bits of same-magnitude data) are skipped.
+static void radix_sort_keys(uint64_t *keys, uint64_t *tmp, size_t (*counts)[RADIX_BUCKETS],
+                            size_t n) {
+    enum { PASSES = RADIX_PASSES, BUCKETS = RADIX_BUCKETS };
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t key = keys[i];
+        for (int pass = 0; pass < PASSES; pass++) {
+            counts[pass][(key >> (pass * RADIX_BITS)) & (BUCKETS - 1)]++;
+        }
+    }
+
+    uint64_t *src = keys;
+    uint64_t *dst = tmp;
+    for (int pass = 0; pass < PASSES; pass++) {
+        size_t *count = counts[pass];
+        int shift = pass * RADIX_BITS;
+        if (count[(src[0] >> shift) & (BUCKETS - 1)] == n) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            size_t c = count[b];
+            count[b] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; i++) {
+            uint64_t key = src[i];
+            dst[count[(key >> shift) & (BUCKETS - 1)]++] = key;
+        }
+
+        uint64_t *swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != keys) {
+        memcpy(keys, src, n * sizeof(uint64_t));
+    }
+}
+
+// Radix sort of doubles, in place. Returns -1 (leaving the array as it
+// was) if the scratch buffers cannot be allocated.
+int radix_sort_double(double *values, size_t n) {
+    uint64_t *tmp = malloc(n * sizeof(uint64_t));
+    size_t (*counts)[RADIX_BUCKETS] = calloc(RADIX_PASSES, sizeof(*counts));
+    if (!tmp || !counts) {
+        free(tmp);
+        free(counts);
+        return -1;
+    }
+
+    // Keys are built in place: the array is only read back as doubles
+    // after key_to_double() has restored every slot
+    uint64_t *keys = (uint64_t *)(void *)values;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t key = double_to_key(values[i]);
+        memcpy(&keys[i], &key, sizeof(key));
+    }
+
+    radix_sort_keys(keys, tmp, counts, n);
+
+    for (size_t i = 0; i < n; i++) {
+        double x = key_to_double(keys[i]);
+        memcpy(&values[i], &x, sizeof(x));
+    }
+    free(tmp);
+    free(counts);
+    return 0;
+}
+
+// Bucket of a key for sample sort: the number of splitters below it, so
+// equal keys always land in the same bucket
+static inline int key_bucket(uint64_t key, const uint64_t *splitters, int n_splitters) {
+    int lo = 0;
+    int hi = n_splitters;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (splitters[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Phase 1: turn a slice of doubles into keys and count them per bucket
+static void* sample_sort_count_worker(void *arg) {
+    SortJob *job = arg;
+    for (size_t i = job->begin; i < job->end; i++) {
+        uint64_t key = double_to_key(job->values[i]);
+        memcpy(&job->keys[i], &key, sizeof(key));
+        job->offsets[key_bucket(key, job->splitters, job->n_buckets - 1)]++;
+    }
+    return NULL;
+}
+
+// Phase 2: scatter the slice into its reserved places in each bucket
+static void* sample_sort_scatter_worker(void *arg) {
+    SortJob *job = arg;
+    for (size_t i = job->begin; i < job->end; i++) {
+        uint64_t key = job->keys[i];
+        job->tmp[job->offsets[key_bucket(key, job->splitters, job->n_buckets - 1)]++] = key;
+    }
+    return NULL;
+}
+
+// Phase 3: radix sort one bucket (the matching part of the original array
+// is free by now and serves as scratch) and write it back as doubles
+static void* sample_sort_bucket_worker(void *arg) {
+    SortJob *job = arg;
+    size_t n = job->bucket_end - job->bucket_begin;
+    if (n == 0) {
+        return NULL;
+    }
+    uint64_t *bucket = job->tmp + job->bucket_begin;
+    radix_sort_keys(bucket, job->keys + job->bucket_begin, job->radix_counts, n);
+    for (size_t i = 0; i < n; i++) {
+        double x = key_to_double(bucket[i]);
+        memcpy(&job->values[job->bucket_begin + i], &x, sizeof(x));
+    }
+    return NULL;
+}
+
+// Parallel sample sort on the same keys as radix_sort_double(), so the
+// result is identical to the serial sort. Regularly spaced samples pick
+// threads - 1 splitters; each thread counts and scatters its slice of the
+// input into the buckets, then radix sorts one bucket. Returns -1 (array
+// untouched) if the scratch memory cannot be allocated.
+int parallel_sort_double(double *values, size_t n, int threads) {
+    size_t n_samples = (size_t)threads * SORT_OVERSAMPLING;
+    uint64_t *tmp = malloc(n * sizeof(uint64_t));
+    uint64_t *samples = malloc(n_samples * sizeof(uint64_t));
+    SortJob *jobs = calloc((size_t)threads, sizeof(SortJob));
+    size_t *offsets = calloc((size_t)threads * (size_t)threads, sizeof(size_t));
+    size_t (*radix_counts)[RADIX_BUCKETS] =
+        calloc((size_t)threads * RADIX_PASSES, sizeof(*radix_counts));
+    if (!tmp || !samples || !jobs || !offsets || !radix_counts) {
+        free(tmp);
+        free(samples);
+        free(jobs);
+        free(offsets);
+        free(radix_counts);
+        return -1;
+    }
+
+    size_t stride = n / n_samples;
+    for (size_t s = 0; s < n_samples; s++) {
+        samples[s] = double_to_key(values[s * stride + stride / 2]);
+    }
+    qsort(samples, n_samples, sizeof(uint64_t), compare_u64);
+    for (int b = 0; b < threads - 1; b++) {
+        samples[b] = samples[(size_t)(b + 1) * SORT_OVERSAMPLING];
+    }
+
+    uint64_t *keys = (uint64_t *)(void *)values;
+    for (int t = 0; t < threads; t++) {
+        jobs[t].values = values;
+        jobs[t].keys = keys;
+        jobs[t].tmp = tmp;
+        jobs[t].splitters = samples;
+        jobs[t].n_buckets = threads;
+        jobs[t].offsets = offsets + (size_t)t * (size_t)threads;
+        jobs[t].radix_counts = radix_counts + (size_t)t * RADIX_PASSES;
+        jobs[t].begin = n / (size_t)threads * (size_t)t;
+        jobs[t].end = t == threads - 1 ? n : n / (size_t)threads * (size_t)(t + 1);
+    }
+    run_workers(sample_sort_count_worker, jobs, sizeof(SortJob), threads);
+
+    // Bucket b of slice t starts after all smaller buckets and after the
+    // same bucket of earlier slices
+    size_t position = 0;
+    for (int b = 0; b < threads; b++) {
+        jobs[b].bucket_begin = position;
+        for (int t = 0; t < threads; t++) {
+            size_t c = jobs[t].offsets[b];
+            jobs[t].offsets[b] = position;
+            position += c;
+        }
+        jobs[b].bucket_end = position;
+    }
+    run_workers(sample_sort_scatter_worker, jobs, sizeof(SortJob), threads);
+    run_workers(sample_sort_bucket_worker, jobs, sizeof(SortJob), threads);
+
+    free(tmp);
+    free(samples);
+    free(jobs);
+    free(offsets);
+    free(radix_counts);
+    return 0;
+}
+
+// Fully sort values ascending: qsort() for short arrays, where the radix
+// passes cost more than they save, radix sort above RADIX_SORT_MIN, and
+// sample sort across threads above PARALLEL_SORT_MIN
+void sort_doubles(double *values, size_t n, int threads) {
+    if (threads > 1 && n >= PARALLEL_SORT_MIN &&
+        parallel_sort_double(values, n, threads) == 0) {
+        return;
+    }
+    if (n < RADIX_SORT_MIN || radix_sort_double(values, n) != 0) {
+        qsort(values, n, sizeof(double), compare_double);
+    }
+}
+
+int compare_float(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    if (isnan(x) || isnan(y)) {
+        return !!isnan(x) - !!isnan(y);
+    }
+    return (x > y) - (x < y);
+}
+
+// double_to_key() for floats
+static inline uint32_t float_to_key(float x) {
+    uint32_t bits;
+    if (isnan(x)) {
+        return UINT32_MAX;
+    }
+    memcpy(&bits, &x, sizeof(bits));
+    return (bits >> 31) ? ~bits : bits | (1U << 31);
+}
+
+static inline float key_to_float(uint32_t key) {
+    uint32_t bits = (key >> 31) ? key & ~(1U << 31) : ~key;
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+// Radix sort of floats, in place, on 32-bit keys (three RADIX_BITS digits),
+// so the scratch buffer is as small as the array. Returns -1 (leaving the
+// array as it was) if the scratch buffer cannot be allocated.
+int radix_sort_float(float *values, size_t n) {
+    enum { PASSES = (32 + RADIX_BITS - 1) / RADIX_BITS, BUCKETS = RADIX_BUCKETS };
+    uint32_t *tmp = malloc(n * sizeof(uint32_t));
+    size_t (*counts)[RADIX_BUCKETS] = calloc(PASSES, sizeof(*counts));
+    if (!tmp || !counts) {
+        free(tmp);
+        free(counts);
+        return -1;
+    }
+
+    uint32_t *keys = (uint32_t *)(void *)values;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t key = float_to_key(values[i]);
+        memcpy(&keys[i], &key, sizeof(key));
+        for (int pass = 0; pass < PASSES; pass++) {
+            counts[pass][(key >> (pass * RADIX_BITS)) & (BUCKETS - 1)]++;
+        }
+    }
+
+    uint32_t *src = keys;
+    uint32_t *dst = tmp;
+    for (int pass = 0; pass < PASSES; pass++) {
+        size_t *count = counts[pass];
+        int shift = pass * RADIX_BITS;
+        if (count[(src[0] >> shift) & (BUCKETS - 1)] == n) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            size_t c = count[b];
+            count[b] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; i++) {
+            uint32_t key = src[i];
+            dst[count[(key >> shift) & (BUCKETS - 1)]++] = key;
+        }
+
+        uint32_t *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != keys) {
+        memcpy(keys, src, n * sizeof(uint32_t));
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        float x = key_to_float(keys[i]);
+        memcpy(&values[i], &x, sizeof(x));
+    }
+    free(tmp);
+    free(counts);
+    return 0;
+}
+
+// sort_doubles() for --float32 (without the parallel sample sort)
+void sort_floats(float *values, size_t n) {
+    if (n < RADIX_SORT_MIN || radix_sort_float(values, n) != 0) {
+        qsort(values, n, sizeof(float), compare_float);
+    }
+}
+
+// Deterministic xorshift64* stream for --bench-sort inputs
+static double bench_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (double)((*state * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+// Time qsort() against radix sort (and the parallel sample sort when
+// threads > 1) on uniform, skewed and already sorted inputs of n values
+// (best of BENCH_RUNS) and check they all agree
+int run_sort_benchmark(size_t n, int threads) {
+    static const char *inputs[] = {"uniform", "skewed", "sorted"};
+    int engines = threads > 1 ? 3 : 2;
+    double *source = malloc(n * sizeof(double));
+    double *work = malloc(n * sizeof(double));
+    double *reference = malloc(n * sizeof(double));
+    if (!source || !work || !reference) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(source);
+        free(work);
+        free(reference);
+        return 1;
+    }
+
+    int identical = 1;
+    printf("Sort benchmark for %zu values (best of %d):\n", n, BENCH_RUNS);
+    for (int input = 0; input < 3; input++) {
+        uint64_t state = 0x9E3779B97F4A7C15ULL;
+        for (size_t i = 0; i < n; i++) {
+            double u = bench_random(&state);
+            if (input == 0) {
+                source[i] = u * 2000.0 - 1000.0;
+            } else if (input == 1) {
+                source[i] = pow(-log(1.0 - u), 3.0);  // Heavy right tail
+            } else {
+                source[i] = (double)i * 0.5;
+            }
+        }
+
+        double best[3] = {INFINITY, INFINITY, INFINITY};
+        for (int run = 0; run < BENCH_RUNS; run++) {
+            for (int which = 0; which < engines; which++) {
+                double *target = which == 0 ? reference : work;
+                memcpy(target, source, n * sizeof(double));
+                double start = now_seconds();
+                if (which == 0) {
+                    qsort(target, n, sizeof(double), compare_double);
+                } else {
+                    sort_doubles(target, n, which == 1 ? 1 : threads);
+                }
+                double elapsed = now_seconds() - start;
+                if (elapsed < best[which]) {
+                    best[which] = elapsed;
+                }
+                if (which > 0) {
+                    identical = identical && memcmp(reference, work, n * sizeof(double)) == 0;
+                }
+            }
+        }
+
+        printf("  %-8s qsort %8.4f s  radix %8.4f s (%.2fx)", inputs[input],
+               best[0], best[1], best[0] / best[1]);
+        if (engines == 3) {
+            printf("  %d threads %8.4f s (%.2fx)", threads, best[2], best[0] / best[2]);
+        }
+        printf("\n");
+    }
+    printf("  Results: %s\n", identical ? "identical" : "MISMATCH");
+
+    free(source);
+    free(work);
+    free(reference);
+    return identical ? 0 : 1;
+}
+
+// Where a percentile falls among count sorted values: rank *lower, and
+// *weight towards rank *lower + 1. Returns 0 if there is no next rank to
+// interpolate with (the value at *lower is the answer).
+int percentile_rank(size_t count, double percentile, size_t *lower, double *weight) {
+    if (count <= 1) {
+        *lower = 0;
+        *weight = 0.0;
+        return 0;
+    }
+
+    double index = percentile * (count - 1);
+    *lower = (size_t)index;
+    *weight = index - *lower;
+    if (*lower + 1 >= count) {
+        *lower = count - 1;
+        return 0;
+    }
+    return 1;
+}
+
+double get_percentile(double *sorted_values, size_t count, double percentile) {
+    if (count == 0) return 0.0;
+
+    size_t lower;
+    double weight;
+    if (!percentile_rank(count, percentile, &lower, &weight)) {
+        return sorted_values[lower];
+    }
+    return sorted_values[lower] * (1 - weight) + sorted_values[lower + 1] * weight;
+}
+
+static inline void swap_double(double *a, double *b) {
+    double tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void insertion_sort_double(double *a, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        double x = a[i];
+        size_t j = i;
+        while (j > 0 && a[j - 1] > x) {
+            a[j] = a[j - 1];
+            j--;
+        }
+        a[j] = x;
+    }
+}
+
+// Guaranteed-linear pivot for introselect(): the median of the medians of
+// groups of five, which are gathered at the front of a
+static double median_of_medians(double *a, size_t n) {
+    size_t groups = 0;
+    for (size_t i = 0; i + 5 <= n; i += 5) {
+        insertion_sort_double(a + i, 5);
+        swap_double(&a[groups++], &a[i + 2]);
+    }
+    if (groups == 0) {
+        insertion_sort_double(a, n);
+        return a[n / 2];
+    }
+    introselect(a, groups, groups / 2);
+    return a[groups / 2];
+}
+
+// Rounds of median-of-three pivots a selection over n values gets before
+// it falls back to median-of-medians
+static int select_budget(size_t n) {
+    int budget = 4;
+    for (size_t m = n; m > 1; m >>= 1) {
+        budget += 2;
+    }
+    return budget;
+}
+
+// Three-way partition of a[lo, hi) around a median-of-three pivot, or a
+// median-of-medians one once *budget is spent. Afterwards [lo, *lt) <
+// pivot, [*lt, *gt) == pivot (those ranks are final) and [*gt, hi) > pivot.
+static void partition_double(double *a, size_t lo, size_t hi, int *budget,
+                             size_t *lt_out, size_t *gt_out) {
+    double pivot;
+    if ((*budget)-- > 0) {
+        double x = a[lo], y = a[lo + (hi - lo) / 2], z = a[hi - 1];
+        pivot = x < y ? (y < z ? y : (x < z ? z : x))
+                      : (x < z ? x : (y < z ? z : y));
+    } else {
+        pivot = median_of_medians(a + lo, hi - lo);
+    }
+
+    size_t lt = lo, i = lo, gt = hi;
+    while (i < gt) {
+        if (a[i] < pivot) {
+            swap_double(&a[lt++], &a[i++]);
+        } else if (a[i] > pivot) {
+            swap_double(&a[i], &a[--gt]);
+        } else {
+            i++;
+        }
+    }
+    *lt_out = lt;
+    *gt_out = gt;
+}
+
+// Rearrange a[0, n) so that a[k] holds the value it would have if the array
+// were sorted, with nothing larger before it and nothing smaller after it.
+// Quickselect with a median-of-three pivot and a three-way partition (cheap
+// on repeated values); after too many unbalanced rounds it switches to
+// median-of-medians pivots, so the worst case stays O(n).
+void introselect(double *a, size_t n, size_t k) {
+    size_t lo = 0;
+    size_t hi = n;
+    int budget = select_budget(n);
+
+    while (hi - lo > SELECT_INSERTION_MAX) {
+        size_t lt, gt;
+        partition_double(a, lo, hi, &budget, &lt, &gt);
+        if (k < lt) {
+            hi = lt;
+        } else if (k >= gt) {
+            lo = gt;
+        } else {
+            return;
+        }
+    }
+    insertion_sort_double(a + lo, hi - lo);
+}
+
+static void multiselect_range(double *a, size_t lo, size_t hi, const size_t *ranks,
+                              size_t n_ranks, int budget) {
+    while (n_ranks > 0) {
+        if (n_ranks == 1) {
+            introselect(a + lo, hi - lo, ranks[0] - lo);
+            return;
+        }
+        if (hi - lo <= SELECT_INSERTION_MAX) {
+            insertion_sort_double(a + lo, hi - lo);
+            return;
+        }
+
+        // Ranks in [lt, gt) hold the pivot and are done; the others are
+        // split into those left of lt and those from gt on
+        size_t lt, gt;
+        partition_double(a, lo, hi, &budget, &lt, &gt);
+        size_t left = 0;
+        while (left < n_ranks && ranks[left] < lt) {
+            left++;
+        }
+        size_t right = left;
+        while (right < n_ranks && ranks[right] < gt) {
+            right++;
+        }
+        multiselect_range(a, lo, lt, ranks, left, budget);
+        lo = gt;
+        ranks += right;
+        n_ranks -= right;
+    }
+}
+
+// introselect() for several ranks at once (ranks ascending): afterwards
+// each a[ranks[i]] holds its sorted value. Every partition splits the
+// requested ranks between its two sides and only sides that still hold
+// one are partitioned further, so k ranks cost O(n log k), not a sort.
+void multiselect(double *a, size_t n, const size_t *ranks, size_t n_ranks) {
+    multiselect_range(a, 0, n, ranks, n_ranks, select_budget(n));
+}
+
+static int compare_size(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+// The ranks get_percentile() reads for each percentile (0 to 1), sorted
+// and without repeats. ranks needs room for 2 * n entries.
+size_t percentile_ranks(size_t count, const double *percentiles, size_t n, size_t *ranks) {
+    size_t n_ranks = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t lower;
+        double weight;
+        int interpolate = percentile_rank(count, percentiles[i], &lower, &weight);
+        ranks[n_ranks++] = lower;
+        if (interpolate) {
+            ranks[n_ranks++] = lower + 1;
+        }
+    }
+    qsort(ranks, n_ranks, sizeof(size_t), compare_size);
+    size_t unique = 0;
+    for (size_t i = 0; i < n_ranks; i++) {
+        if (unique == 0 || ranks[i] != ranks[unique - 1]) {
+            ranks[unique++] = ranks[i];
+        }
+    }
+    return unique;
+}
+
+// --float32 versions of the selection functions above, on 4-byte values
+
+static inline void swap_float(float *a, float *b) {
+    float tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void insertion_sort_float(float *a, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        float x = a[i];
+        size_t j = i;
+        while (j > 0 && a[j - 1] > x) {
+            a[j] = a[j - 1];
+            j--;
+        }
+        a[j] = x;
+    }
+}
+
+static float median_of_medians_float(float *a, size_t n) {
+    size_t groups = 0;
+    for (size_t i = 0; i + 5 <= n; i += 5) {
+        insertion_sort_float(a + i, 5);
+        swap_float(&a[groups++], &a[i + 2]);
+    }
+    if (groups == 0) {
+        insertion_sort_float(a, n);
+        return a[n / 2];
+    }
+    introselect_float(a, groups, groups / 2);
+    return a[groups / 2];
+}
+
+static void partition_float(float *a, size_t lo, size_t hi, int *budget,
+                            size_t *lt_out, size_t *gt_out) {
+    float pivot;
+    if ((*budget)-- > 0) {
+        float x = a[lo], y = a[lo + (hi - lo) / 2], z = a[hi - 1];
+        pivot = x < y ? (y < z ? y : (x < z ? z : x))
+                      : (x < z ? x : (y < z ? z : y));
+    } else {
+        pivot = median_of_medians_float(a + lo, hi - lo);
+    }
+
+    size_t lt = lo, i = lo, gt = hi;
+    while (i < gt) {
+        if (a[i] < pivot) {
+            swap_float(&a[lt++], &a[i++]);
+        } else if (a[i] > pivot) {
+            swap_float(&a[i], &a[--gt]);
+        } else {
+            i++;
+        }
+    }
+    *lt_out = lt;
+    *gt_out = gt;
+}
+
+void introselect_float(float *a, size_t n, size_t k) {
+    size_t lo = 0;
+    size_t hi = n;
+    int budget = select_budget(n);
+
+    while (hi - lo > SELECT_INSERTION_MAX) {
+        size_t lt, gt;
+        partition_float(a, lo, hi, &budget, &lt, &gt);
+        if (k < lt) {
+            hi = lt;
+        } else if (k >= gt) {
+            lo = gt;
+        } else {
+            return;
+        }
+    }
+    insertion_sort_float(a + lo, hi - lo);
+}
+
+static void multiselect_float_range(float *a, size_t lo, size_t hi, const size_t *ranks,
+                                    size_t n_ranks, int budget) {
+    while (n_ranks > 0) {
+        if (n_ranks == 1) {
+            introselect_float(a + lo, hi - lo, ranks[0] - lo);
+            return;
+        }
+        if (hi - lo <= SELECT_INSERTION_MAX) {
+            insertion_sort_float(a + lo, hi - lo);
+            return;
+        }
+
+        size_t lt, gt;
+        partition_float(a, lo, hi, &budget, &lt, &gt);
+        size_t left = 0;
+        while (left < n_ranks && ranks[left] < lt) {
+            left++;
+        }
+        size_t right = left;
+        while (right < n_ranks && ranks[right] < gt) {
+            right++;
+        }
+        multiselect_float_range(a, lo, lt, ranks, left, budget);
+        lo = gt;
+        ranks += right;
+        n_ranks -= right;
+    }
+}
+
+void multiselect_float(float *a, size_t n, const size_t *ranks, size_t n_ranks) {
+    multiselect_float_range(a, 0, n, ranks, n_ranks, select_budget(n));
+}
+
+// get_percentile() of a sorted (or multiselected) float array, in double
+double get_percentile_float(const float *sorted_values, size_t count, double percentile) {
+    if (count == 0) return 0.0;
+
+    size_t lower;
+    double weight;
+    if (!percentile_rank(count, percentile, &lower, &weight)) {
+        return sorted_values[lower];
+    }
+    return sorted_values[lower] * (1 - weight) + sorted_values[lower + 1] * weight;
+}
+
+// log2(x) for --log-hist binning, from the exponent bits and a series in
+// the mantissa (error below 1e-9). The vector kernels do exactly the same
+// operations, so a value lands in the same bin on every code path.
+#define HIST_SQRT2 1.4142135623730951
+#define HIST_LOG2_C1 2.8853900817779268     // 2 / ln 2
+#define HIST_LOG2_C3 0.9617966939259756     // 2 / (3 ln 2) ...
+#define HIST_LOG2_C5 0.5770780163555853
+#define HIST_LOG2_C7 0.4121985831111324
+#define HIST_LOG2_C9 0.3205988979753252
+#define HIST_LOG2_C11 0.2623081892525388
+#define HIST_MANTISSA 0x000fffffffffffffULL
+#define HIST_ONE 0x3ff0000000000000ULL      // Bits of 1.0
+#define HIST_TWO52 4503599627370496.0       // 2^52
+
+static double hist_log2(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    double e = (double)(bits >> 52) - 1023.0;
+    uint64_t mbits = (bits & HIST_MANTISSA) | HIST_ONE;
+    double m;
+    memcpy(&m, &mbits, sizeof(m));
+    if (m > HIST_SQRT2) {   // Keep m in [sqrt(1/2), sqrt(2)) for a short series
+        m = m * 0.5;
+        e = e + 1.0;
+    }
+    double t = (m - 1.0) / (m + 1.0);
+    double t2 = t * t;
+    double series = HIST_LOG2_C9 + t2 * HIST_LOG2_C11;
+    series = HIST_LOG2_C7 + t2 * series;
+    series = HIST_LOG2_C5 + t2 * series;
+    series = HIST_LOG2_C3 + t2 * series;
+    series = HIST_LOG2_C1 + t2 * series;
+    return e + t * series;
+}
+
+// Bin of one value, or h->bins if it falls outside the bins. Written as
+// the vector kernels compute it: max/min keep the bound when bin is NaN.
+static size_t histogram_bin(const Histogram *h, double x) {
+    int keep = h->log_scale ? x > 0 : x == x;
+    double bin = ((h->log_scale ? hist_log2(x) : x) - h->offset) * h->scale;
+    bin = bin > 0.0 ? bin : 0.0;
+    double top = (double)(h->bins - 1);
+    bin = bin < top ? bin : top;
+    return keep ? (size_t)bin : h->bins;
+}
+
+typedef void (*HistogramKernel)(const double *values, size_t n, const Histogram *h,
+                                uint64_t *counts);
+
+static void histogram_block_scalar(const double *values, size_t n, const Histogram *h,
+                                   uint64_t *counts) {
+    for (size_t i = 0; i < n; i++) {
+        counts[histogram_bin(h, values[i])]++;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The vector kernels compute the bins of 2 or 4 values at once; only the
+// count increments, which may hit the same bin, are done one by one.
+
+static __m128d hist_log2_sse2(__m128d x) {
+    __m128i bits = _mm_castpd_si128(x);
+    __m128i magic = _mm_castpd_si128(_mm_set1_pd(HIST_TWO52));
+    __m128d e = _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128(_mm_srli_epi64(bits, 52), magic)),
+                           _mm_set1_pd(HIST_TWO52));
+    e = _mm_sub_pd(e, _mm_set1_pd(1023.0));
+    __m128d m = _mm_castsi128_pd(
+        _mm_or_si128(_mm_and_si128(bits, _mm_set1_epi64x((long long)HIST_MANTISSA)),
+                     _mm_set1_epi64x((long long)HIST_ONE)));
+    __m128d big = _mm_cmpgt_pd(m, _mm_set1_pd(HIST_SQRT2));
+    m = _mm_or_pd(_mm_and_pd(big, _mm_mul_pd(m, _mm_set1_pd(0.5))), _mm_andnot_pd(big, m));
+    e = _mm_or_pd(_mm_and_pd(big, _mm_add_pd(e, _mm_set1_pd(1.0))), _mm_andnot_pd(big, e));
+    __m128d one = _mm_set1_pd(1.0);
+    __m128d t = _mm_div_pd(_mm_sub_pd(m, one), _mm_add_pd(m, one));
+    __m128d t2 = _mm_mul_pd(t, t);
+    __m128d series = _mm_add_pd(_mm_set1_pd(HIST_LOG2_C9), _mm_mul_pd(t2, _mm_set1_pd(HIST_LOG2_C11)));
+    series = _mm_add_pd(_mm_set1_pd(HIST_LOG2_C7), _mm_mul_pd(t2, series));
+    series = _mm_add_pd(_mm_set1_pd(HIST_LOG2_C5), _mm_mul_pd(t2, series));
+    series = _mm_add_pd(_mm_set1_pd(HIST_LOG2_C3), _mm_mul_pd(t2, series));
+    series = _mm_add_pd(_mm_set1_pd(HIST_LOG2_C1), _mm_mul_pd(t2, series));
+    return _mm_add_pd(e, _mm_mul_pd(t, series));
+}
+
+static void histogram_block_sse2(const double *values, size_t n, const Histogram *h,
+                                 uint64_t *counts) {
+    __m128d offset = _mm_set1_pd(h->offset), scale = _mm_set1_pd(h->scale);
+    __m128d top = _mm_set1_pd((double)(h->bins - 1)), outside = _mm_set1_pd((double)h->bins);
+    __m128d zero = _mm_setzero_pd();
+    size_t done = n & ~(size_t)1;
+    for (size_t i = 0; i < done; i += 2) {
+        __m128d x = _mm_loadu_pd(values + i);
+        __m128d keep, bin;
+        if (h->log_scale) {
+            keep = _mm_cmpgt_pd(x, zero);
+            bin = _mm_mul_pd(_mm_sub_pd(hist_log2_sse2(x), offset), scale);
+        } else {
+            keep = _mm_cmpord_pd(x, x);
+            bin = _mm_mul_pd(_mm_sub_pd(x, offset), scale);
+        }
+        bin = _mm_min_pd(_mm_max_pd(bin, zero), top);
+        bin = _mm_or_pd(_mm_and_pd(keep, bin), _mm_andnot_pd(keep, outside));
+        int32_t index[4];
+        _mm_storeu_si128((__m128i *)index, _mm_cvttpd_epi32(bin));
+        counts[index[0]]++;
+        counts[index[1]]++;
+    }
+    histogram_block_scalar(values + done, n - done, h, counts);
+}
+
+__attribute__((target("avx2")))
+static __m256d hist_log2_avx2(__m256d x) {
+    __m256i bits = _mm256_castpd_si256(x);
+    __m256i magic = _mm256_castpd_si256(_mm256_set1_pd(HIST_TWO52));
+    __m256d e = _mm256_sub_pd(
+        _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), magic)),
+        _mm256_set1_pd(HIST_TWO52));
+    e = _mm256_sub_pd(e, _mm256_set1_pd(1023.0));
+    __m256d m = _mm256_castsi256_pd(
+        _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x((long long)HIST_MANTISSA)),
+                        _mm256_set1_epi64x((long long)HIST_ONE)));
+    __m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(HIST_SQRT2), _CMP_GT_OQ);
+    m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+    e = _mm256_blendv_pd(e, _mm256_add_pd(e, _mm256_set1_pd(1.0)), big);
+    __m256d one = _mm256_set1_pd(1.0);
+    __m256d t = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one));
+    __m256d t2 = _mm256_mul_pd(t, t);
+    __m256d series = _mm256_add_pd(_mm256_set1_pd(HIST_LOG2_C9),
+                                   _mm256_mul_pd(t2, _mm256_set1_pd(HIST_LOG2_C11)));
+    series = _mm256_add_pd(_mm256_set1_pd(HIST_LOG2_C7), _mm256_mul_pd(t2, series));
+    series = _mm256_add_pd(_mm256_set1_pd(HIST_LOG2_C5), _mm256_mul_pd(t2, series));
+    series = _mm256_add_pd(_mm256_set1_pd(HIST_LOG2_C3), _mm256_mul_pd(t2, series));
+    series = _mm256_add_pd(_mm256_set1_pd(HIST_LOG2_C1), _mm256_mul_pd(t2, series));
+    return _mm256_add_pd(e, _mm256_mul_pd(t, series));
+}
+
+__attribute__((target("avx2")))
+static void histogram_block_avx2(const double *values, size_t n, const Histogram *h,
+                                 uint64_t *counts) {
+    __m256d offset = _mm256_set1_pd(h->offset), scale = _mm256_set1_pd(h->scale);
+    __m256d top = _mm256_set1_pd((double)(h->bins - 1));
+    __m256d outside = _mm256_set1_pd((double)h->bins);
+    __m256d zero = _mm256_setzero_pd();
+    size_t done = n & ~(size_t)3;
+    for (size_t i = 0; i < done; i += 4) {
+        __m256d x = _mm256_loadu_pd(values + i);
+        __m256d keep, bin;
+        if (h->log_scale) {
+            keep = _mm256_cmp_pd(x, zero, _CMP_GT_OQ);
+            bin = _mm256_mul_pd(_mm256_sub_pd(hist_log2_avx2(x), offset), scale);
+        } else {
+            keep = _mm256_cmp_pd(x, x, _CMP_ORD_Q);
+            bin = _mm256_mul_pd(_mm256_sub_pd(x, offset), scale);
+        }
+        bin = _mm256_min_pd(_mm256_max_pd(bin, zero), top);
+        bin = _mm256_blendv_pd(outside, bin, keep);
+        int32_t index[4];
+        _mm_storeu_si128((__m128i *)index, _mm256_cvttpd_epi32(bin));
+        counts[index[0]]++;
+        counts[index[1]]++;
+        counts[index[2]]++;
+        counts[index[3]]++;
+    }
+    histogram_block_scalar(values + done, n - done, h, counts);
+}
+
+#endif
+
+static HistogramKernel histogram_kernel = histogram_block_scalar;
+static pthread_once_t histogram_kernel_once = PTHREAD_ONCE_INIT;
+
+static void select_histogram_kernel(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        histogram_kernel = histogram_block_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        histogram_kernel = histogram_block_sse2;
+    }
+#endif
+}
+
+// One thread's slice for histogram_compute(), counted into its own bins
+typedef struct {
+    const double *values;
+    const float *floats;    // Used instead of values for --float32
+    size_t n;
+    const Histogram *h;
+    uint64_t *counts;
+} HistogramJob;
+
+static void* histogram_worker(void *arg) {
+    HistogramJob *job = arg;
+    if (!job->floats) {
+        histogram_kernel(job->values, job->n, job->h, job->counts);
+        return NULL;
+    }
+    double block[MOMENT_BLOCK];
+    for (size_t i = 0; i < job->n; i += MOMENT_BLOCK) {
+        size_t len = job->n - i < MOMENT_BLOCK ? job->n - i : MOMENT_BLOCK;
+        for (size_t j = 0; j < len; j++) {
+            block[j] = job->floats[i + j];
+        }
+        histogram_kernel(block, len, job->h, job->counts);
+    }
+    return NULL;
+}
+
+// Histogram of an in-memory array for --hist (values, or floats with
+// --float32), using the minimum and maximum already in stats. Each thread
+// counts its slice into private bins and the bins are added up at the end.
+// Sets *out to NULL (with a warning) when the values have no usable range.
+// Returns -1 if out of memory.
+int histogram_compute(const double *values, const float *floats, size_t n, const Stats *stats,
+                      const Config *config, Histogram **out) {
+    *out = NULL;
+    double lo = stats->min, hi = stats->max;
+    if (config->log_hist && !(lo > 0)) {
+        // Log bins start at the smallest positive value
+        lo = INFINITY;
+        for (size_t i = 0; i < n; i++) {
+            double x = floats ? floats[i] : values[i];
+            if (x > 0 && x < lo) {
+                lo = x;
+            }
+        }
+    }
+    if (!isfinite(lo) || !isfinite(hi)) {
+        fprintf(stderr, config->log_hist
+                    ? "Warning: No histogram: --log-hist needs finite positive values\n"
+                    : "Warning: No histogram: the values are not all finite\n");
+        return 0;
+    }
+
+    Histogram *h = malloc(sizeof(Histogram));
+    int threads = config->threads;
+    if ((size_t)threads > n / REDUCE_CHUNK + 1) {
+        threads = (int)(n / REDUCE_CHUNK + 1);
+    }
+    size_t slots = config->hist_bins + 1;
+    uint64_t *counts = calloc((size_t)threads * slots, sizeof(uint64_t));
+    HistogramJob *jobs = malloc((size_t)threads * sizeof(HistogramJob));
+    if (!h || !counts || !jobs) {
+        free(h);
+        free(counts);
+        free(jobs);
+        return -1;
+    }
+
+    h->log_scale = config->log_hist;
+    h->lo = lo;
+    h->hi = hi;
+    h->offset = h->log_scale ? hist_log2(lo) : lo;
+    double span = (h->log_scale ? hist_log2(hi) : hi) - h->offset;
+    h->bins = span > 0 ? config->hist_bins : 1;     // All values equal: one bin
+    h->scale = span > 0 ? (double)h->bins / span : 0.0;
+    h->counts = counts;
+
+    pthread_once(&histogram_kernel_once, select_histogram_kernel);
+    for (int t = 0; t < threads; t++) {
+        size_t begin = n * (size_t)t / (size_t)threads;
+        jobs[t].values = floats ? NULL : values + begin;
+        jobs[t].floats = floats ? floats + begin : NULL;
+        jobs[t].n = n * (size_t)(t + 1) / (size_t)threads - begin;
+        jobs[t].h = h;
+        jobs[t].counts = counts + (size_t)t * slots;
+    }
+    run_workers(histogram_worker, jobs, sizeof(HistogramJob), threads);
+    for (int t = 1; t < threads; t++) {
+        for (size_t b = 0; b < slots; b++) {
+            counts[b] += counts[(size_t)t * slots + b];
+        }
+    }
+    free(jobs);
+    *out = h;
+    return 0;
+}
+
+void histogram_free(Histogram *h) {
+    if (h) {
+        free(h->counts);
+        free(h);
+    }
+}
+
+// Edge i of the bins: 0 is the lower edge of the first, bins the upper
+// edge of the last
+double histogram_edge(const Histogram *h, size_t i) {
+    if (i == 0 || h->scale == 0) return h->lo;
+    if (i == h->bins) return h->hi;
+    double at = h->offset + (double)i / h->scale;
+    return h->log_scale ? exp2(at) : at;
+}
+
+// Move every NaN to the end of a and return how many values precede them.
+// Selection and sorting then only see that prefix, so the default path and
+// --sort both rank NaNs above every number, as the radix keys do.
+static size_t nans_last(double *a, size_t n) {
+    size_t end = n;
+    for (size_t i = 0; i < end; ) {
+        if (isnan(a[i])) {
+            double t = a[i];
+            a[i] = a[--end];
+            a[end] = t;
+        } else {
+            i++;
+        }
+    }
+    return end;
+}
+
+static size_t nans_last_float(float *a, size_t n) {
+    size_t end = n;
+    for (size_t i = 0; i < end; ) {
+        if (isnan(a[i])) {
+            float t = a[i];
+            a[i] = a[--end];
+            a[end] = t;
+        } else {
+            i++;
+        }
+    }
+    return end;
+}
+
+// Drop the ranks at or past the first NaN (ranks ascending): those
+// positions already hold NaNs
+static size_t ranks_below(const size_t *ranks, size_t n_ranks, size_t limit) {
+    while (n_ranks > 0 && ranks[n_ranks - 1] >= limit) {
+        n_ranks--;
+    }
+    return n_ranks;
+}
+
+// What calculate_stats() reports, as fractions: the quartiles (Q1, median,
+// Q3), then --percentiles. Returns the count.
+static size_t wanted_quantiles(const Config *config, double *wanted) {
+    wanted[0] = 0.25;
+    wanted[1] = 0.50;
+    wanted[2] = 0.75;
+    for (size_t i = 0; i < config->n_percentiles; i++) {
+        wanted[3 + i] = config->percentiles[i] / 100;
+    }
+    return 3 + config->n_percentiles;
+}
+
+// Selection (or --sort) runs on the values themselves, so they come back
+// reordered. Nothing after parsing needs the input order: the moments and
+// the histogram counts do not depend on it. Returns -1 only if the
+// histogram cannot be allocated.
+int calculate_stats(double *values, size_t count, Stats *stats, const Config *config) {
+    // Calculate sum, min, max, mean and variance in one vectorized pass,
+    // split across the worker threads
+    Moments moments;
+    moments_reduce(values, count, config->threads, &moments);
+    stats_from_moments(&moments, stats);
+    stats->has_quantiles = 1;
+
+    double wanted[MAX_PERCENTILES + 3];
+    size_t n_wanted = wanted_quantiles(config, wanted);
+    size_t ordered = nans_last(values, count);
+
+    if (config->full_sort) {
+        sort_doubles(values, ordered, config->threads);
+    } else {
+        // Settle only the ranks the percentiles interpolate between, in one
+        // multi-selection instead of a full sort
+        size_t ranks[2 * (MAX_PERCENTILES + 3)];
+        size_t n_ranks = percentile_ranks(count, wanted, n_wanted, ranks);
+        multiselect(values, ordered, ranks, ranks_below(ranks, n_ranks, ordered));
+    }
+    stats->q1 = get_percentile(values, count, wanted[0]);
+    stats->median = get_percentile(values, count, wanted[1]);
+    stats->q3 = get_percentile(values, count, wanted[2]);
+    stats->n_percentiles = config->n_percentiles;
+    for (size_t i = 0; i < config->n_percentiles; i++) {
+        stats->percentiles[i] = config->percentiles[i];
+        stats->percentile_values[i] = get_percentile(values, count, wanted[3 + i]);
+    }
+
+    if (config->hist_bins) {
+        return histogram_compute(values, NULL, count, stats, config, &stats->histogram);
+    }
+    return 0;
+}
+
+// calculate_stats() for input that must not be written, such as a
+// read-only f64le mapping: works on a scratch copy. Returns -1 if the copy
+// cannot be made.
+int calculate_stats_copy(const double *values, size_t count, Stats *stats, const Config *config) {
+    double *scratch = store_alloc(count * sizeof(double));
+    if (!scratch) {
+        return -1;
+    }
+    memcpy(scratch, values, count * sizeof(double));
+    int status = calculate_stats(scratch, count, stats, config);
+    store_free(scratch);
+    return status;
+}
+
+// calculate_stats() for --float32: moments are accumulated in double,
+// selection and sorting reorder the 4-byte values in place
+int calculate_stats_float(float *values, size_t count, Stats *stats, const Config *config) {
+    Moments moments;
+    moments_reduce_float(values, count, config->threads, &moments);
+    stats_from_moments(&moments, stats);
+    stats->has_quantiles = 1;
+
+    double wanted[MAX_PERCENTILES + 3];
+    size_t n_wanted = wanted_quantiles(config, wanted);
+    size_t ordered = nans_last_float(values, count);
+    if (config->full_sort) {
+        sort_floats(values, ordered);
+    } else {
+        size_t ranks[2 * (MAX_PERCENTILES + 3)];
+        size_t n_ranks = percentile_ranks(count, wanted, n_wanted, ranks);
+        multiselect_float(values, ordered, ranks, ranks_below(ranks, n_ranks, ordered));
+    }
+    stats->q1 = get_percentile_float(values, count, wanted[0]);
+    stats->median = get_percentile_float(values, count, wanted[1]);
+    stats->q3 = get_percentile_float(values, count, wanted[2]);
+    stats->n_percentiles = config->n_percentiles;
+    for (size_t i = 0; i < config->n_percentiles; i++) {
+        stats->percentiles[i] = config->percentiles[i];
+        stats->percentile_values[i] = get_percentile_float(values, count, wanted[3 + i]);
+    }
+
+    if (config->hist_bins) {
+        return histogram_compute(NULL, values, count, stats, config, &stats->histogram);
+    }
+    return 0;
+}
+
+// Bins as rows of [lower, upper) edges, count and a bar scaled to the
+// fullest bin. The last bin includes its upper edge (the maximum).
+static void print_histogram_text(const Histogram *h, int precision) {
+    int edge_width = 0, count_width = 1;
+    uint64_t most = 0;
+    for (size_t i = 0; i <= h->bins; i++) {
+        int width = snprintf(NULL, 0, "%.*f", precision, histogram_edge(h, i));
+        if (width > edge_width) edge_width = width;
+    }
+    for (size_t b = 0; b < h->bins; b++) {
+        if (h->counts[b] > most) most = h->counts[b];
+    }
+    for (uint64_t c = most; c >= 10; c /= 10) {
+        count_width++;
+    }
+
+    printf("  Histogram (%zu bin%s%s):\n", h->bins, h->bins == 1 ? "" : "s",
+           h->log_scale ? ", log scale" : "");
+    for (size_t b = 0; b < h->bins; b++) {
+        int bar = most ? (int)((h->counts[b] * HIST_BAR_WIDTH + most - 1) / most) : 0;
+        printf("    [%*.*f, %*.*f%c  %*llu", edge_width, precision, histogram_edge(h, b),
+               edge_width, precision, histogram_edge(h, b + 1), b + 1 == h->bins ? ']' : ')',
+               count_width, (unsigned long long)h->counts[b]);
+        if (bar > 0) {
+            printf("  %.*s", bar, HIST_BAR);
+        }
+        putchar('\n');
+    }
+    if (h->counts[h->bins]) {
+        printf("    %llu values outside the bins (%s)\n", (unsigned long long)h->counts[h->bins],
+               h->log_scale ? "NaN or not positive" : "NaN");
+    }
+}
+
+void print_stats_text(Stats *stats, int precision) {
     printf("Statistics for %zu numbers:\n", stats->count);
     printf("  Sum:     %.*f\n", precision, stats->sum);
     printf("  Mean:    %.*f\n", precision, stats->mean);
-    printf("  Median:  %.*f\n", precision, stats->median);
+    if (stats->has_quantiles) {
+        printf("  Median:  %.*f\n", precision, stats->median);
+    }
     printf("  Minimum: %.*f\n", precision, stats->min);
     printf("  Maximum: %.*f\n", precision, stats->max);
     printf("  Range:   %.*f\n", precision, stats->range);
-    printf("  Q1:      %.*f\n", precision, stats->q1);
-    printf("  Q3:      %.*f\n", precision, stats->q3);
+    if (stats->has_quantiles) {
+        printf("  Q1:      %.*f\n", precision, stats->q1);
+        printf("  Q3:      %.*f\n", precision, stats->q3);
+    }
+    for (size_t i = 0; i < stats->n_percentiles; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "P%g:", stats->percentiles[i]);
+        printf("  %-9s%.*f\n", label, precision, stats->percentile_values[i]);
+    }
     printf("  StdDev:  %.*f\n", precision, stats->stddev);
+    if (!isnan(stats->rank_error)) {
+        printf("  Quartiles are t-digest estimates, rank error <= %.4f%%\n",
+               stats->rank_error * 100);
+    }
+    if (!isnan(stats->value_error)) {
+        printf("  Quantiles are HDR histogram estimates, relative error <= %.4f%%\n",
+               stats->value_error * 100);
+    }
+    if (stats->histogram) {
+        print_histogram_text(stats->histogram, precision);
+    }
+}
+
+// The members of a Stats JSON object, each line prefixed with indent
+static void print_json_fields(Stats *stats, int precision, const char *indent) {
+    printf("%s\"count\": %zu,\n", indent, stats->count);
+    printf("%s\"sum\": %.*f,\n", indent, precision, stats->sum);
+    printf("%s\"mean\": %.*f,\n", indent, precision, stats->mean);
+    if (stats->has_quantiles) {
+        printf("%s\"median\": %.*f,\n", indent, precision, stats->median);
+    }
+    printf("%s\"min\": %.*f,\n", indent, precision, stats->min);
+    printf("%s\"max\": %.*f,\n", indent, precision, stats->max);
+    printf("%s\"range\": %.*f,\n", indent, precision, stats->range);
+    if (stats->has_quantiles) {
+        printf("%s\"q1\": %.*f,\n", indent, precision, stats->q1);
+        printf("%s\"q3\": %.*f,\n", indent, precision, stats->q3);
+    }
+    for (size_t i = 0; i < stats->n_percentiles; i++) {
+        printf("%s\"p%g\": %.*f,\n", indent, stats->percentiles[i], precision,
+               stats->percentile_values[i]);
+    }
+    printf("%s\"stddev\": %.*f", indent, precision, stats->stddev);
+    if (!isnan(stats->rank_error)) {
+        printf(",\n%s\"rank_error\": %.6f", indent, stats->rank_error);
+    }
+    if (!isnan(stats->value_error)) {
+        printf(",\n%s\"relative_error\": %.6f", indent, stats->value_error);
+    }
+    if (stats->histogram) {
+        const Histogram *h = stats->histogram;
+        printf(",\n%s\"histogram\": {\n", indent);
+        printf("%s  \"scale\": \"%s\",\n", indent, h->log_scale ? "log" : "linear");
+        printf("%s  \"edges\": [", indent);
+        for (size_t i = 0; i <= h->bins; i++) {
+            printf("%s%.*f", i ? ", " : "", precision, histogram_edge(h, i));
+        }
+        printf("],\n%s  \"counts\": [", indent);
+        for (size_t b = 0; b < h->bins; b++) {
+            printf("%s%llu", b ? ", " : "", (unsigned long long)h->counts[b]);
+        }
+        printf("],\n%s  \"outside\": %llu\n%s}", indent,
+               (unsigned long long)h->counts[h->bins], indent);
+    }
 }
 
 void print_stats_json(Stats *stats, int precision) {
     printf("{\n");
-    printf("  \"count\": %zu,\n", stats->count);
-    printf("  \"sum\": %.*f,\n", precision, stats->sum);
-    printf("  \"mean\": %.*f,\n", precision, stats->mean);
-    printf("  \"median\": %.*f,\n", precision, stats->median);
-    printf("  \"min\": %.*f,\n", precision, stats->min);
-    printf("  \"max\": %.*f,\n", precision, stats->max);
-    printf("  \"range\": %.*f,\n", precision, stats->range);
-    printf("  \"q1\": %.*f,\n", precision, stats->q1);
-    printf("  \"q3\": %.*f,\n", precision, stats->q3);
-    printf("  \"stddev\": %.*f\n", precision, stats->stddev);
-    printf("}\n");
+    print_json_fields(stats, precision, "  ");
+    printf("\n}\n");
+}
+
+// A JSON string literal, escaping what JSON requires
+static void print_json_string(const char *str) {
+    putchar('"');
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            printf("\\%c", *p);
+        } else if (*p < 0x20) {
+            printf("\\u%04x", *p);
+        } else {
+            putchar(*p);
+        }
+    }
+    putchar('"');
+}
+
+static const char* table_name(Table *table, size_t c) {
+    return c < table->n_names && table->names[c][0] ? table->names[c] : NULL;
+}
+
+static void table_column_stats(Table *table, size_t c, Stats *stats) {
+    stats_from_moments(&table->moments[c], stats);
+    if (table->digests[c] && table->moments[c].count > 0) {
+        stats_from_tdigest(table->digests[c], NULL, 0, stats);
+    }
+}
+
+void print_table_text(Table *table, int precision) {
+    for (size_t c = 0; c < table->n_columns; c++) {
+        const char *name = table_name(table, c);
+        if (c > 0) {
+            printf("\n");
+        }
+        printf("Column %zu%s%s%s:\n", c + 1, name ? " (" : "", name ? name : "", name ? ")" : "");
+        if (table->moments[c].count == 0) {
+            printf("  No valid numbers\n");
+            continue;
+        }
+        Stats stats;
+        table_column_stats(table, c, &stats);
+        print_stats_text(&stats, precision);
+    }
+}
+
+static void group_stats_record(Group *group, Stats *stats) {
+    stats_from_moments(&group->moments, stats);
+    if (group->digest) {
+        stats_from_tdigest(group->digest, NULL, 0, stats);
+    }
+}
+
+void print_groups_text(Group **groups, size_t n, int precision) {
+    for (size_t i = 0; i < n; i++) {
+        Stats stats;
+        group_stats_record(groups[i], &stats);
+        if (i > 0) {
+            printf("\n");
+        }
+        printf("Group %s:\n", groups[i]->key);
+        print_stats_text(&stats, precision);
+    }
+}
+
+void print_groups_json(Group **groups, size_t n, int precision) {
+    printf("[\n");
+    for (size_t i = 0; i < n; i++) {
+        Stats stats;
+        group_stats_record(groups[i], &stats);
+        printf("  {\n    \"group\": ");
+        print_json_string(groups[i]->key);
+        printf(",\n");
+        print_json_fields(&stats, precision, "    ");
+        printf("\n  }%s\n", i + 1 < n ? "," : "");
+    }
+    printf("]\n");
+}
+
+// One --time-col report: the bucket's start time (UTC), then its stats
+void print_bucket(Buckets *buckets) {
+    Stats stats;
+    stats_from_moments(&buckets->moments, &stats);
+    if (buckets->digest) {
+        stats_from_tdigest(buckets->digest, NULL, 0, &stats);
+    }
+
+    char when[32];
+    time_t start = (time_t)(buckets->index * buckets->width);
+    struct tm tm;
+    if (!gmtime_r(&start, &tm) || !strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", &tm)) {
+        snprintf(when, sizeof(when), "%lld", (long long)start);
+    }
+
+    int precision = buckets->precision;
+    int json = buckets->json_output;
+    printf(json ? "{\"time\": \"%s\", \"count\": %zu" : "time=%s count=%zu", when, stats.count);
+    printf(json ? ", \"sum\": %.*f, \"mean\": %.*f" : " sum=%.*f mean=%.*f",
+           precision, stats.sum, precision, stats.mean);
+    if (stats.has_quantiles) {
+        printf(json ? ", \"median\": %.*f" : " median=%.*f", precision, stats.median);
+    }
+    printf(json ? ", \"min\": %.*f, \"max\": %.*f" : " min=%.*f max=%.*f",
+           precision, stats.min, precision, stats.max);
+    if (stats.has_quantiles) {
+        printf(json ? ", \"q1\": %.*f, \"q3\": %.*f" : " q1=%.*f q3=%.*f",
+               precision, stats.q1, precision, stats.q3);
+    }
+    printf(json ? ", \"stddev\": %.*f}\n" : " stddev=%.*f\n", precision, stats.stddev);
+}
+
+// One --window report: position in the input, then the window's stats
+void print_window(Window *window) {
+    int precision = window->precision;
+    double stddev = sqrt(window->m2 / (double)window->count);
+    double min = deque_at(&window->min, 0)->value;
+    double max = deque_at(&window->max, 0)->value;
+    if (window->json_output) {
+        printf("{\"n\": %llu, \"count\": %zu, \"mean\": %.*f, \"stddev\": %.*f, "
+               "\"min\": %.*f, \"max\": %.*f",
+               (unsigned long long)window->seen, window->count, precision, window->mean,
+               precision, stddev, precision, min, precision, max);
+    } else {
+        printf("n=%llu count=%zu mean=%.*f stddev=%.*f min=%.*f max=%.*f",
+               (unsigned long long)window->seen, window->count, precision, window->mean,
+               precision, stddev, precision, min, precision, max);
+    }
+    for (size_t i = 0; i < window->n_percentiles; i++) {
+        double value = window_percentile(window, window->percentiles[i] / 100);
+        printf(window->json_output ? ", \"p%g\": %.*f" : " p%g=%.*f",
+               window->percentiles[i], precision, value);
+    }
+    printf(window->json_output ? "}\n" : "\n");
+}
+
+void print_table_json(Table *table, int precision) {
+    printf("[\n");
+    for (size_t c = 0; c < table->n_columns; c++) {
+        const char *name = table_name(table, c);
+        printf("  {\n    \"column\": %zu", c + 1);
+        if (name) {
+            printf(",\n    \"name\": ");
+            print_json_string(name);
+        }
+        if (table->moments[c].count == 0) {
+            printf(",\n    \"count\": 0");
+        } else {
+            Stats stats;
+            table_column_stats(table, c, &stats);
+            printf(",\n");
+            print_json_fields(&stats, precision, "    ");
+        }
+        printf("\n  }%s\n", c + 1 < table->n_columns ? "," : "");
+    }
+    printf("]\n");
 }